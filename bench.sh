@@ -0,0 +1,264 @@
+#!/bin/bash
+#
+#  Name:     bench.sh
+#  Revision: 5.0.2
+#  Purpose:  Benchmarks upis and the libupis bus helpers without a UPiS, against the kernel
+#            i2c-stub driver loaded with a PiCo register image at 0x69, 0x6A and 0x6B
+#  Usage:    sudo ./bench.sh [-n RUNS] [-t TRANSPORT] [-u UPIS], or make bench
+#            CC, CFLAGS and LIBS are used to build the benchmarks, see Makefile for the i2c headers
+#            -n  Runs of each benchmark, 200 by default
+#            -t  i2c-dev for i2c-stub, the default, or sim[:LATENCY[:ERRORS]] for the built in
+#                simulator, which needs neither root nor i2c-stub
+#            -u  upis binary to benchmark, to compare builds. Default is to build this tree
+#  Output:   One line per benchmark, after a # line describing the run:
+#            bench=NAME runs=N mean_us=MEAN p99_us=P99 transactions=PEROP syscalls=PEROP
+#            Times are wall clock microseconds per operation, including process start for the
+#            CLI options. syscalls is - when strace is not installed. The stub holds still
+#            registers, so the RTC does not tick and written values stay as written
+#
+
+set -u
+
+runs=200
+transport=i2c-dev
+upis=
+base=0x69
+src=$(cd "$(dirname "$0")" && pwd)
+tmp=$(mktemp -d)
+stub=0
+
+while getopts "n:t:u:" option; do
+  case $option in
+    n) runs=$OPTARG ;;
+    t) transport=$OPTARG ;;
+    u) upis=$OPTARG ;;
+    *) exit 1 ;;
+  esac
+done
+
+cleanup()
+{
+  if [ $stub = 1 ]; then
+    rmmod i2c-stub
+  fi
+  rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+fail()
+{
+  echo "Error: $*" >&2
+  exit 1
+}
+
+# Loads i2c-stub with the PiCo addresses and sets bus to the bus it adds
+loadstub()
+{
+  local adapter
+
+  [ "$(id -u)" = 0 ] || fail "i2c-stub can only be loaded by root, or use -t sim"
+  command -v i2cset > /dev/null || fail "i2cset of i2c-tools is needed to load the register image"
+  [ -d /sys/module/i2c_stub ] && fail "i2c-stub is already loaded, unload it first"
+  modprobe i2c-stub chip_addr=$base,$((base + 1)),$((base + 2)) || fail "Unable to load i2c-stub"
+  stub=1
+  modprobe i2c-dev 2> /dev/null
+  for adapter in /sys/bus/i2c/devices/i2c-*; do
+    if grep -q "SMBus stub driver" "$adapter/name"; then
+      bus=${adapter##*i2c-}
+    fi
+  done
+  [ -n "${bus:-}" ] || fail "Unable to find the i2c-stub bus"
+}
+
+# Writes the bytes given from register 0 of a PiCo address up
+loadpage()
+{
+  local addr=$1
+  local reg=0
+
+  shift
+  for value in "$@"; do
+    i2cset -y "$bus" $addr $reg $value || fail "Unable to load register $reg of address $addr"
+    reg=$((reg + 1))
+  done
+}
+
+# Loads the power on and factory default state of the PiCo, as the simulator does in simreset
+loadimage()
+{
+  # RTC: BCD seconds, minutes, hours, day of week 1-7, day, month, year, correction factor
+  loadpage $base 0x$(date +%S) 0x$(date +%M) 0x$(date +%H) 0x0$(($(date +%w) + 1)) 0x$(date +%d) 0x$(date +%m) 0x$(date +%y) 0x00
+  # Status: EPR, BAT 4.12V, RPI 5.08V, USB 0V, EPR 12.10V, 450mA, 25C, 77F, BCD words low byte first
+  loadpage $((base + 1)) 0x01 0x12 0x04 0x08 0x05 0x00 0x00 0x10 0x12 0x50 0x04 0x25 0x77 0x00
+  # Config: firmware 0x32, no error, watchdog and FSSD BAT timer off, FSSD 120s, LPR 60s, relay and IO off
+  loadpage $((base + 2)) 0x32 0x00 0xff 0x78 0x00 0xff 0x00 0x00 0x00 0x00 0x3c 0x00 0x00 0x00 0x00 0x00 0x00 0x00 0x00
+}
+
+# Prints the mean and 99th percentile of a file of microsecond samples
+summary()
+{
+  sort -n "$1" | awk '{ value[NR] = $1; sum += $1 }
+    END { p = int(NR * 0.99); if (p < NR * 0.99) p++; if (p < 1) p = 1; printf "%.1f %.1f", sum / NR, value[p] }'
+}
+
+# Prints the system calls made by a command, or - without strace
+syscalls()
+{
+  if ! command -v strace > /dev/null; then
+    echo -
+    return
+  fi
+  strace -f -c -o "$tmp/strace" "$@" > /dev/null 2>&1
+  awk '/ total$/ { print $4 }' "$tmp/strace"
+}
+
+# Times runs of a upis command line. The transactions come from its --stats
+benchcli()
+{
+  local name=$1
+  local start
+  local end
+  local run
+  local status
+  local transactions
+  local calls
+
+  shift
+  transactions=$("$upis" --bus "$bus" "$@" --stats 2>&1 > /dev/null | awk '/^Transactions:/ { print $2 }')
+  calls=$(syscalls "$upis" --bus "$bus" "$@")
+  : > "$tmp/samples"
+  for ((run = 0; run < runs; run++)); do
+    start=${EPOCHREALTIME/[.,]/}
+    "$upis" --bus "$bus" "$@" > /dev/null 2>&1
+    status=$?
+    end=${EPOCHREALTIME/[.,]/}
+    if [ $status != 0 ]; then
+      echo "bench=$name error=$status"
+      return
+    fi
+    echo $((end - start)) >> "$tmp/samples"
+  done
+  set -- $(summary "$tmp/samples")
+  echo "bench=$name runs=$runs mean_us=$1 p99_us=$2 transactions=${transactions:-0} syscalls=$calls"
+}
+
+# Times calls of a libupis helper in one process. Transactions and system calls are those of runs
+# calls less those of none, so opening the bus is left out
+benchhelper()
+{
+  local name=$1
+  local transactions
+  local calls
+
+  transactions=$("$tmp/helpers" $name $runs $bus 2>&1 > "$tmp/ns" | awk '/^Transactions:/ { print $2 }')
+  transactions=$((transactions - $("$tmp/helpers" $name 0 $bus 2>&1 > /dev/null | awk '/^Transactions:/ { print $2 }')))
+  calls=$(syscalls "$tmp/helpers" $name $runs $bus)
+  if [ "$calls" != - ]; then
+    calls=$(awk -v runs=$runs -v calls=$calls -v none=$(syscalls "$tmp/helpers" $name 0 $bus) \
+            'BEGIN { printf "%.2f", (calls - none) / runs }')
+  fi
+  awk '{ printf "%.3f\n", $1 / 1000 }' "$tmp/ns" > "$tmp/samples"
+  set -- $(summary "$tmp/samples")
+  echo "bench=$name runs=$runs mean_us=$1 p99_us=$2 transactions=$(awk -v t=$transactions -v runs=$runs 'BEGIN { printf "%.2f", t / runs }') syscalls=$calls"
+}
+
+if [ "$transport" = i2c-dev ]; then
+  loadstub
+  loadimage
+else
+  bus=1
+fi
+export UPIS_TRANSPORT=$transport
+
+if [ -z "$upis" ]; then
+  upis=$tmp/upis
+  ${CC:-gcc} ${CFLAGS:--O2} -pthread -o "$upis" "$src/upis.c" "$src/libupis.c" -lm ${LIBS:-} || fail "Unable to build upis"
+fi
+
+# Calls a libupis helper RUNS times on BUS after one untimed call, printing nanoseconds per call
+cat > "$tmp/helpers.c" << 'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libupispriv.h"
+
+static void call(const char *name)
+{
+  static struct upissnapshot snapshot;
+  unsigned char page[UPIS_STATUS_LEN];
+  struct tm rtc;
+
+  if (strcmp(name,"readi2cbyte") == 0) {
+    readi2cbyte(i2cdevice.bus,0x6A,0x00);
+  } else if (strcmp(name,"readi2cword") == 0) {
+    readi2cword(i2cdevice.bus,0x6A,0x01);
+  } else if (strcmp(name,"readi2cblock") == 0) {
+    readi2cblock(i2cdevice.bus,0x6A,0x00,UPIS_STATUS_LEN,page);
+  } else if (strcmp(name,"writei2cbyte") == 0) {
+    writei2cbyte(i2cdevice.bus,0x6B,0x02,0xFF);
+  } else if (strcmp(name,"readrtc") == 0) {
+    readrtc(&rtc);
+  } else if (strcmp(name,"readsnapshot") == 0) {
+    readsnapshot(&snapshot);
+  } else {
+    printf("Error: Unknown helper %s\n",name);
+    exit(1);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  struct timespec begin;
+  struct timespec end;
+  long runs = atol(argv[2]);
+  long run;
+
+  i2cdevice.bus = atoi(argv[3]);
+  if (getenv(UPIS_TRANSPORT_ENV)) {
+    i2cselect(getenv(UPIS_TRANSPORT_ENV));
+  }
+  call(argv[1]);
+  statsstart();
+  for (run = 0; run < runs; run++) {
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    call(argv[1]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%lld\n",elapsedns(&begin, &end));
+  }
+  statsreport();
+  return 0;
+}
+EOF
+${CC:-gcc} ${CFLAGS:--O2} -pthread -I"$src" -o "$tmp/helpers" "$tmp/helpers.c" "$src/libupis.c" ${LIBS:-} || fail "Unable to build the helper benchmark"
+
+printf 'fssdtimeout=120\nlprtimer=60\nrelay=0\n' > "$tmp/profile"
+for line in 1 2 3 4 5; do
+  printf 'batvolt\n--rpivolt --current\n'
+done > "$tmp/batch"
+
+echo "# upis bench transport=$transport bus=$bus runs=$runs upis=$upis date=$(date +%Y-%m-%dT%H:%M:%S)"
+
+# Each option displaying a value
+for option in rtc rtcfactor pwrsrc batvolt rpivolt eprvolt usbvolt current centigrade fahrenheit \
+              fwver errorno watchdog fssdtimeout fssdtype fssdbatime lprtimer relay iomode iovalue; do
+  benchcli $option --$option
+done
+# Options setting a value, to the value of the image
+benchcli set-fssdtimeout --fssdtimeout=120
+benchcli set-lprtimer --lprtimer=60
+benchcli set-relay --relay=0
+benchcli set-rtcfactor --rtcfactor=0
+# Combined scrapes
+benchcli scrape-status -s -b -p -e -u -a -c -f
+benchcli scrape-config -Q -E -w -t -T -B -L -r -i
+benchcli scrape-mixed -R -b -a -t
+benchcli all --all
+benchcli all-json --all --format json
+benchcli dump-profile --dump-profile
+benchcli apply-unchanged --apply "$tmp/profile"
+benchcli batch-10 --batch "$tmp/batch"
+# Bus helpers of libupis, in one process
+for helper in readi2cbyte readi2cword readi2cblock writei2cbyte readrtc readsnapshot; do
+  benchhelper $helper
+done
@@ -0,0 +1,2299 @@
+/*
+  Name:     libupis.c
+  Revision: 5.0.2
+  Purpose:  Bus access, register map and decoding of the UPiS PiCo interface, behind the
+            API of libupis.h. The upis and upisd front-ends are built on top of it
+  Build:    make libupis.so libupis.a, see Makefile for the i2c-tools headers needed, or
+            gcc -pthread -fPIC -shared -o libupis.so libupis.c             (shared)
+            gcc -pthread -c libupis.c && ar rcs libupis.a libupis.o        (static)
+*/
+
+#include <linux/i2c-dev.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "libupispriv.h"
+
+/* Bus transport: every bus access of a session goes through one of these.
+   All functions return a negative value on failure, like the i2c-dev calls they wrap */
+struct i2ctransport {
+  const char *name;
+  int (*open)(unsigned int i2cbus);                 /* Returns a descriptor */
+  void (*close)(int file);
+  unsigned long (*funcs)(int file);                 /* I2C_FUNCS bits */
+  int (*slave)(int file, unsigned int i2caddr);     /* I2C_SLAVE */
+  int (*readbyte)(int file, unsigned int i2creg);
+  int (*readword)(int file, unsigned int i2creg);
+  int (*writebyte)(int file, unsigned int i2creg, unsigned int i2cval);
+  int (*readblock)(int file, unsigned int i2creg, unsigned int i2clen, unsigned char *i2cbuf);
+  int (*rdwr)(int file, struct i2c_msg *msgs, unsigned int nmsgs); /* I2C_RDWR */
+  int (*limits)(int file, int timeout, int retries); /* I2C_TIMEOUT in milliseconds and I2C_RETRIES, -1 leaves either as is */
+};
+
+/* I2C bus session, opened on first use and closed at exit. Each thread has its own session */
+struct i2csession {
+  int file;         /* Descriptor of the open /dev/i2c-N, -1 when closed */
+  unsigned int bus; /* Bus number the descriptor belongs to */
+  int addr;         /* Slave address currently selected with I2C_SLAVE, -1 for none */
+  unsigned long funcs; /* Adapter functionality bits from I2C_FUNCS */
+  int registered;   /* Set once i2cclose has been registered with atexit */
+  const struct i2ctransport *transport; /* Set by i2cselect, i2c-dev when NULL */
+  int lock;         /* Descriptor of the bus lock file, -1 when closed */
+  unsigned int lockbus; /* Bus number the lock file belongs to */
+  int locked;       /* Nesting depth of i2clock, the lock is held while above 0 */
+};
+static __thread struct i2csession i2c = { -1, 0, -1, 0, 0, NULL, -1, 0, 0 };
+
+/* Advisory lock shared by every process accessing a bus, taken with flock around each logical
+   operation, such as a batch read or a write and its read back, so operations of concurrent
+   invocations are not interleaved. %u is the bus number */
+#define UPIS_LOCK_PATH "/run/lock/upis-i2c-%u.lock"
+/* Default milliseconds to wait for the lock before giving up, see --lock-wait */
+#define UPIS_LOCK_WAIT 1000
+/* Longest pause, in microseconds, between attempts to take a busy lock */
+#define UPIS_LOCK_BACKOFF 1000
+long i2clockwait = UPIS_LOCK_WAIT;
+
+/* Bounds on each transaction. A failed transaction is attempted again up to i2cretries times after a
+   jittered backoff starting at I2C_RETRY_BACKOFF microseconds and doubling up to I2C_RETRY_BACKOFF_MAX.
+   i2ctimeout and i2cadapterretries are passed to the adapter when the bus is opened, -1 leaves them */
+#define I2C_RETRIES_DEFAULT 2
+#define I2C_RETRY_BACKOFF 1000
+#define I2C_RETRY_BACKOFF_MAX 64000
+unsigned int i2cretries = I2C_RETRIES_DEFAULT;
+int i2ctimeout = -1;
+int i2cadapterretries = -1;
+
+/* Bus usage of a session, reported on stderr by --stats. Wall time is split into sections,
+   such as the planned reads and each option displayed, see statssection. The counters are
+   shared by every thread, the sections belong to the thread that called statsstart */
+#define I2C_STATS_SECTIONS 48
+/* Transaction latency is recorded per register a transaction starts at, registers 0x00-0x1F of each
+   PiCo address, in log linear buckets of microseconds: 0-7 exactly, then 8 per power of two */
+#define I2C_LATENCY_REGS 0x20
+#define I2C_LATENCY_BUCKETS 200
+struct i2cstatsection {
+  const char *name;
+  long long ns;                 /* Wall time spent in the section */
+  unsigned long transactions;   /* Transactions issued during the section */
+  unsigned long bytes;          /* Bytes moved during the section */
+};
+struct i2cstats {
+  int enabled;
+  unsigned long opens;          /* Bus opens */
+  unsigned long slaves;         /* I2C_SLAVE switches */
+  unsigned long transactions;   /* SMBus calls and I2C_RDWR ioctls */
+  unsigned long bytes;          /* Command, register and data bytes moved, excluding slave addresses */
+  long long busns;              /* Time spent inside transactions */
+  long long lockns;             /* Time spent waiting for the bus lock */
+  unsigned long contended;      /* Bus locks that were held by another process */
+  unsigned long retries;        /* Failed transactions attempted again */
+  unsigned int latency[3][I2C_LATENCY_REGS][I2C_LATENCY_BUCKETS]; /* Transactions per bucket, see latencybucket */
+  long long latencymax[3][I2C_LATENCY_REGS];                     /* Slowest transaction in nanoseconds */
+  pthread_t thread;             /* Thread that called statsstart */
+  struct timespec start;        /* When statsstart was called */
+  struct timespec mark;         /* Start of the current section */
+  unsigned int sections;
+  struct i2cstatsection section[I2C_STATS_SECTIONS];
+};
+static struct i2cstats i2cstats;
+
+/* Registers modelled per PiCo address by the simulator transport */
+#define PICOSIM_REGS 0x20
+/* State of the simulated PiCo interface. The RTC runs off the system clock plus an offset.
+   Each thread, and so each bus, has its own PiCo, answering at the base address of i2cdevice */
+struct picosim {
+  int ready;                                /* Registers hold their power on values */
+  unsigned char regs[3][PICOSIM_REGS];      /* Registers of 0x69, 0x6A and 0x6B */
+  unsigned int pointer[3];                  /* Register pointer of each address for plain I2C transfers */
+  int addr;                                 /* Slave address selected with I2C_SLAVE, as 0x69-0x6B */
+  time_t rtcoffset;                         /* Seconds between the system clock and the RTC */
+  long latency;                             /* Microseconds taken by each transaction */
+  long errors;                              /* Transactions in a thousand failing with EIO */
+  int timeout;                              /* Milliseconds before a transaction fails with ETIMEDOUT, -1 for none */
+  unsigned int seed;                        /* Picks the failing transactions */
+};
+static __thread struct picosim picosim;
+
+/* Combined I2C_RDWR transaction: each item writes a register address and reads a
+   range back, so the items can span several slave addresses. The kernel accepts
+   at most I2C_RDWR_IOCTL_MAX_MSGS (42) messages per ioctl, two per item */
+#define I2C_BATCH_MAX 21
+struct i2cbatchitem {
+  unsigned int addr;  /* Slave address */
+  unsigned char reg;  /* First register, sent as the write message */
+  unsigned int len;   /* Number of registers read */
+  unsigned char *buf; /* Receives the registers */
+};
+struct i2cbatch {
+  unsigned int count;
+  struct i2cbatchitem items[I2C_BATCH_MAX];
+};
+
+/* Snapshot served in place of bus reads when it is fresh enough, see readcache */
+__thread struct upissnapshot *i2ccache = NULL;
+
+/* Device accessed by the calling thread, see struct upisdevice */
+__thread struct upisdevice i2cdevice = { 1, 0x69 };
+/* Moves a default device address, 0x69-0x6B, to the device in use */
+#define UPIS_DEVICE_ADDR(addr) ((addr) - 0x69 + i2cdevice.base)
+
+/* Where upisfail returns to while a library call is in progress, and why it failed */
+static __thread jmp_buf *upisjump = NULL;
+static __thread char upismessage[128];
+
+/* An open session on one PiCo interface, see upisopen. Its state is loaded into the calling
+   thread for the length of each call, see upisenter and upisleave */
+struct upis {
+  struct upisdevice device;
+  struct i2csession session;
+  struct picosim sim;
+  char error[sizeof(upismessage)];
+};
+
+/* A thread working through the jobs of one bus, in order */
+struct upisworker {
+  pthread_t thread;
+  unsigned int bus;
+  const struct i2ctransport *transport; /* Transport and simulator latency of the main thread */
+  long latency;
+  long errors;
+  struct upisjob *jobs;
+  unsigned int count;
+};
+
+/* Prototypes */
+static void upisfail(int code, const char *format, ...);
+static void upisenter(struct upis *upis, jmp_buf *jump);
+static int upisleave(struct upis *upis, int result);
+static void statsclock(struct timespec *begin);
+static void statstransaction(const struct timespec *begin, unsigned int bytes, unsigned int i2caddr, unsigned int i2creg);
+static int latencybucket(long long ns);
+static long long latencypercentile(const unsigned int *buckets, unsigned long count, int percent);
+static int i2cbackoff(unsigned int attempt);
+static int writecommand(unsigned int i2caddr, unsigned int i2creg, unsigned int i2cval);
+static int i2copenbus(unsigned int i2cbus);
+static int i2copen(unsigned int i2cbus, unsigned int i2caddr);
+static void i2cbatchadd(struct i2cbatch *batch, unsigned int i2caddr, unsigned int i2creg, unsigned int i2clen, unsigned char *i2cbuf);
+static void readi2cbatch(unsigned int i2cbus, struct i2cbatch *batch);
+static int readcache(unsigned int i2caddr, unsigned int i2creg, unsigned int i2clen, unsigned char *i2cbuf);
+static int plancached(unsigned char marks[3][UPIS_PLAN_REGS], unsigned char value[3][UPIS_PLAN_REGS]);
+static void *runworker(void *data);
+static const struct upisshm *shmmap(const char *path, int check);
+static int shmcopy(const struct upisshm *shm, struct upissnapshot *snapshot);
+static int ringvalid(int ringfile, struct upisringhead *head);
+static int devopen(unsigned int i2cbus);
+static void devclose(int file);
+static unsigned long devfuncs(int file);
+static int devslave(int file, unsigned int i2caddr);
+static int devreadbyte(int file, unsigned int i2creg);
+static int devreadword(int file, unsigned int i2creg);
+static int devwritebyte(int file, unsigned int i2creg, unsigned int i2cval);
+static int devreadblock(int file, unsigned int i2creg, unsigned int i2clen, unsigned char *i2cbuf);
+static int devrdwr(int file, struct i2c_msg *msgs, unsigned int nmsgs);
+static int devlimits(int file, int timeout, int retries);
+static int simopen(unsigned int i2cbus);
+static void simclose(int file);
+static unsigned long simfuncs(int file);
+static int simslave(int file, unsigned int i2caddr);
+static int simreadbyte(int file, unsigned int i2creg);
+static int simreadword(int file, unsigned int i2creg);
+static int simwritebyte(int file, unsigned int i2creg, unsigned int i2cval);
+static int simreadblock(int file, unsigned int i2creg, unsigned int i2clen, unsigned char *i2cbuf);
+static int simrdwr(int file, struct i2c_msg *msgs, unsigned int nmsgs);
+static int simlimits(int file, int timeout, int retries);
+static int simread(unsigned int i2caddr, unsigned int i2creg);
+static int simwrite(unsigned int i2caddr, unsigned int i2creg, unsigned int i2cval);
+static void simreset(int factory);
+static int simdelay(void);
+static time_t simclock(void);
+
+/* The transports i2cselect can choose from */
+static const struct i2ctransport i2cdevtransport = {
+  "i2c-dev", devopen, devclose, devfuncs, devslave, devreadbyte, devreadword, devwritebyte, devreadblock, devrdwr, devlimits
+};
+static const struct i2ctransport simtransport = {
+  "sim", simopen, simclose, simfuncs, simslave, simreadbyte, simreadword, simwritebyte, simreadblock, simrdwr, simlimits
+};
+
+/* Every value upis can display or set, in option order. Generates the upis options and drives
+   planning, validation, decoding and display, as well as the fields of --all and socket queries.
+   Order of fields: {NAME, KEY, ARG, ADDR, REG, LEN, KIND, MIN, MAX, SCALE, UNIT, LABEL, WHAT, CONFIRM, DONE, DOC} */
+const struct upisregister upisregisters[] =
+{
+  {"rtc",'R',"RTCFMT",0x69,0x00,UPIS_RTC_LEN,UPIS_KIND_RTC,0,0,1,0,"RTC Date/Time",0,0,0,
+   "Display time from the UPiS RTC in DD-MM-YYY HH:MM:SS (DOW) format. Use epoch to display seconds since 01/01/1970 or iso to display ISO 8601 YYYY-MM-DDTHH:MM:SS format, the RTC is assumed to hold local time"},
+  {"rtcfactor",'F',"RTCF",0x69,0x07,1,UPIS_KIND_BYTE,0,255,1,0,"RTC Correction Factor","RTC clock factor",0,0,
+   "Display, or set, the Real Time Clock correction factor. Valid values are between 0 and 255. Changes the RTC timer in multiples of 1 tick per second where a timer tick is 1/32768 HZ or 0.000030517578125 Seconds. Use 0 or 128 to let the clock run at its normal rate. Values between 1 and 127 will deduct the number of ticks specified per second and make the clock run progressively slower. Values between 129 and 255 will make the clock run progressive faster, where the number of ticks added will the specified value minus 128. In a 24 hour period adding or subtractng one tick changes the RTC by 86400 * 0.000030517578125 = 2.63671875 Seconds"},
+  {"pwrsrc",'s',0,0x6A,0x00,1,UPIS_KIND_PWRSRC,0,0,1,0,"Power source",0,0,0,
+   "Display the current UPiS power source:\n1=EPR,2=USB,3=RPI,4=BAT,5=LPR,6=CPR and 7=BPR\nWhen combined with -v displays power source name rather than number"},
+  {"batvolt",'b',0,0x6A,0x01,2,UPIS_KIND_BCDWORD,0,0,100,"V","BAT voltage",0,0,0,
+   "Display the current UPiS battery voltage in Volts"},
+  {"rpivolt",'p',0,0x6A,0x03,2,UPIS_KIND_BCDWORD,0,0,100,"V","RPI Voltage",0,0,0,
+   "Display the voltage from the Raspberry Pi over the GPIO header in Volts"},
+  {"eprvolt",'e',0,0x6A,0x07,2,UPIS_KIND_BCDWORD,0,0,100,"V","EPR Voltage",0,0,0,
+   "Display the voltage at the UPiS EPR connector in Volts"},
+  {"usbvolt",'u',0,0x6A,0x05,2,UPIS_KIND_BCDWORD,0,0,100,"V","USB Voltage",0,0,0,
+   "Display the voltage at the UPiS USB connector in Volts"},
+  {"current",'a',0,0x6A,0x09,2,UPIS_KIND_BCDWORD,0,0,1,"mA","Average Current Draw",0,0,0,
+   "Display the mean current supplying both the UPiS and Raspberry Pi in mA"},
+  {"centigrade",'c',0,0x6A,0x0B,1,UPIS_KIND_BCD,0,0,1,"C","Centigrade Temperature",0,0,0,
+   "Display the UPiS temperature in Centigrade"},
+  {"fahrenheit",'f',0,0x6A,0x0C,2,UPIS_KIND_BCDWORD,0,0,1,"F","Fahrenheit Temperature",0,0,0,
+   "Display the UPiS temperature in Fahrenheit"},
+  {"fwver",'Q',0,0x6B,0x00,2,UPIS_KIND_WORD,0,0,1,0,"Firmware Version",0,0,0,
+   "Display the UPiS firmware version number"},
+  {"factory",'Z',0,0x69,0x07,0,UPIS_KIND_ACTION,0xdd,0xdd,1,0,0,"Factory reset",
+   "WARNING: The UPiS will be returned to factory default and reset.\n"
+   "This probably isn't a good idea as the Raspberry Pi will also be reset\n"
+   "without a file safe shutdown, resulting in possible file system corruption.\n",0,
+   "Perform a factory reset of the UPiS. Requires confirmation if not used with -y argument"},
+  {"reset",'z',0,0x69,0x07,0,UPIS_KIND_ACTION,0xee,0xee,1,0,0,"Reset",
+   "WARNING: The UPiS processor and RTC will be reset.\n"
+   "This probably isn't a good idea as the Raspberry Pi will also be reset\n"
+   "without a file safe shutdown, resulting in possible file system corruption.\n",0,
+   "Reset the UPiS CPU, apply startup values and reset RTC to 01/01/2012"},
+  {"bootloader",'l',0,0x69,0x07,0,UPIS_KIND_ACTION,0xff,0xff,1,0,0,"Bootloader",
+   "WARNING: The UPiS will be placed in bootloader mode.\n"
+   "1. The Red LED on the UPiS will light.\n"
+   "2. Recovery from this state is only possible by pressing the RST button\n"
+   "   or uploding new firmware.\n"
+   "3. Bootloader mode should be used with the RPi firmware upload script.\n"
+   "3. All interrupts are disabled during this procedure and the normal\n"
+   "   operation of the UPiS is suspended.\n"
+   "5. Both the UPiS and RPi must be powered via RPi micro USB during the\n"
+   "   boot loading process because the UPiS resets after the firmware is\n"
+   "   uploaded.\n",0,
+   "Place the UPiS in bootloader mode (Red LED will flash). Requires confirmation if not used with -y argument"},
+  {"errorno",'E',0,0x6B,0x01,1,UPIS_KIND_BYTE,0,0,1,0,"Last Error No",0,0,0,
+   "Display the last UPiS error code, where 0 equals no error"},
+  {"watchdog",'w',"WDTIM",0x6B,0x02,1,UPIS_KIND_BYTE,0,255,1,0,"Watchdog Timer","watchdog timer",0,0,
+   "Display or set the UPiS watchdog countdown timer in seconds. Setting the timer to 255 will disable it. When the timer reaches 0 seconds file safe shutdown will be triggered"},
+  {"fssd",'S',0,0x6B,0x02,0,UPIS_KIND_ACTION,0x00,0x00,1,0,0,"File safe shutdown",0,"File safe shutdown initiated",
+   "Trigger a file safe shutdown"},
+  {"fssdtimeout",'t',"FSSDTIM",0x6B,0x03,1,UPIS_KIND_BYTE,15,255,1,0,"File Safe Shutdown Timer","file safe shutdown timer",0,0,
+   "Display or set the file safe shutdown power off timer. This is the amount of time the UPiS will wait after initiating file safe shutdown, before power is removed from the Raspberry Pi"},
+  {"fssdtype",'T',"FSSDACT",0x6B,0x04,1,UPIS_KIND_BYTE,0,2,1,0,"File Safe Shutdown Type","file safe shutdown type",0,0,
+   "Display, or set, the UPiS action to be taken upon File Safe Shutdown, 0 will cut power and 1 will leave the Raspberry Pi powered on"},
+  {"fssdbatime",'B',"BATTIM",0x6B,0x05,1,UPIS_KIND_BYTE,0,255,1,0,"File Safe Shutdown BAT Timer","file safe shutdown BAT timer",0,0,
+   "Display, or set, a timer in seconds that will unconditionally cause file safe shutdown in battery mode when it reaches 0. Set to 255 to disable the timer"},
+  {"starttimer",'o',"ONTIM",0,0,0,UPIS_KIND_TODO,0,0,1,0,0,0,0,0,
+   "Display, or set, a timer that will cause the UPiS to wake up from LPR mode after it has been asleep for the sepcified number of seconds"},
+  {"stoptimer",'O',"OFFTIM",0,0,0,UPIS_KIND_TODO,0,0,1,0,0,0,0,0,
+   "Display, or set, a timer that will cause the UPiS to initiate file safe shutdown after it has been awake (out of LPR mode) for the specified number of seconds"},
+  {"lprtimer",'L',"LPRTIM",0x6B,0x0A,1,UPIS_KIND_BYTE,0,255,1,0,"LPR Wakeup Polling Timer","LPR Wakeup Polling timer",0,0,
+   "Display, or set, the interval at which the UPiS will check for the presence of power and wakeup while in LPR mode"},
+  {"relay",'r',"RLYSTAT",0x6B,0x0B,1,UPIS_KIND_RELAY,0,1,1,0,"Relay Status","relay state",0,0,
+   "Display, or set, the relay state. Permissable value are: 1, 0, on, off, open or closed"},
+  {"eprlowv",'h',"EPRLOWV",0,0,0,UPIS_KIND_TODO,0,0,1,0,0,0,0,0,
+   "Display, or set, the EPR supply voltage below which the UPiS will switch to battery mode"},
+  {"minlprtime",'m',"MINLPRTIM",0,0,0,UPIS_KIND_TODO,0,0,1,0,0,0,0,0,
+   "Display, or set, the minimum interval that the UPiS will run in battery mode before resuming EPR power. This can be used to prevent the UPiS toggling between BAT and EPR power unecessarly when the ERP supply is unstable, such as solar power"},
+  {"lprcurrent",'I',"LPRAMP",0,0,0,UPIS_KIND_TODO,0,0,1,0,0,0,0,0,
+   "Display, or set, the current in miliamps drawn by the Raspberry Pi below which the UPiS to switch to LPR mode. Tune this value so that the UPiS correctly switches to LPR mode once the Raspberry Pi is shutdown. The exact current depands on what boards are attached to the Raspberry Pi and USB peripherals"},
+  {"iomode",'i',"IOMODE",0x6B,0x10,1,UPIS_KIND_BYTE,0,3,1,0,"IO Pin Mode","io pin mode",0,0,
+   "Display, or set, the mode of the 1 wire io pin of the UPiS.\n0=none\n1=1 wire temp value\n2=8 bit A to D convertor value\n3= Status of forced On-Change (Advanced Only)"},
+  {"iovalue",'V',0,0x6B,0x10,3,UPIS_KIND_IOVALUE,0,0,1,0,"IO Pin Value",0,0,0,
+   "Display the value read from the 1 wire IO pin based on the mode set by -i"},
+};
+/* Fails to compile when UPIS_REGISTERS in libupis.h does not match the table */
+typedef char upisregisterscheck[sizeof(upisregisters) / sizeof(upisregisters[0]) == UPIS_REGISTERS ? 1 : -1];
+
+/* Library API, see libupis.h */
+struct upis *upisopen(unsigned int bus, unsigned int base, const char *transport)
+{
+  static const struct i2csession closed = { -1, 0, -1, 0, 1, NULL, -1, 0, 0 };
+  /* Locals set before setjmp and used after a failure are volatile, so longjmp cannot clobber them */
+  struct upis *volatile upis = calloc(1, sizeof(struct upis));
+  const char *volatile name = transport ? transport : getenv(UPIS_TRANSPORT_ENV);
+  jmp_buf jump;
+
+  if (!upis) {
+    snprintf(upismessage, sizeof(upismessage), "Out of memory");
+    return NULL;
+  }
+  upis->device.bus = bus;
+  upis->device.base = base;
+  upis->session = closed; /* Registered, so the bus is closed by upisclose rather than at exit */
+  upisenter(upis, &jump);
+  if (setjmp(jump)) {
+    /* The bus may be open when a later step failed, such as setting its timeout */
+    upisleave(upis, -1);
+    upisenter(upis, NULL);
+    i2cclose();
+    upisleave(upis, 0);
+    free(upis);
+    return NULL;
+  }
+  if (base < 0x03 || base > 0x75) {
+    upisfail(1, "Invalid base address 0x%02x",base);
+  }
+  if (name && !i2cselect(name)) {
+    upisfail(1, "Unknown transport %s",name);
+  }
+  i2copenbus(bus);
+  upisleave(upis, 0);
+  return upis;
+}
+
+void upislimits(long lockwait, unsigned int retries, int timeout, int adapterretries)
+{
+  i2clockwait = lockwait;
+  i2cretries = retries;
+  i2ctimeout = timeout;
+  i2cadapterretries = adapterretries;
+}
+
+int upisreadsnapshot(struct upis *upis, struct upissnapshot *snapshot)
+{
+  jmp_buf jump;
+
+  upisenter(upis, &jump);
+  if (setjmp(jump)) {
+    return upisleave(upis, -1);
+  }
+  readsnapshot(snapshot);
+  return upisleave(upis, 0);
+}
+
+int upisread(struct upis *upis, const char *name, double *value)
+{
+  const struct upisregister *volatile reg = registerfind(name);
+  struct upisplan plan;
+  struct tm rtc;
+  jmp_buf jump;
+  int raw;
+
+  upisenter(upis, &jump);
+  if (setjmp(jump)) {
+    return upisleave(upis, -1);
+  }
+  if (!reg || reg->kind == UPIS_KIND_ACTION || reg->kind == UPIS_KIND_TODO) {
+    upisfail(1, "No value named %s",name);
+  }
+  planinit(&plan);
+  planread(&plan, reg->addr, reg->reg, reg->len);
+  runplan(&plan);
+  if (reg->kind == UPIS_KIND_RTC) {
+    decodertc(plan.value[UPIS_PLAN_PAGE(reg->addr)], &rtc);
+    *value = mktime(&rtc);
+    return upisleave(upis, 0);
+  }
+  raw = registervalue(reg, plan.value[UPIS_PLAN_PAGE(reg->addr)]);
+  if (raw < 0) {
+    upisfail(2, "IO pin mode is not set");
+  }
+  *value = (double)raw / reg->scale;
+  return upisleave(upis, 0);
+}
+
+int upiswrite(struct upis *upis, const char *name, int value)
+{
+  const struct upisregister *volatile reg = registerfind(name);
+  struct upisplan plan;
+  jmp_buf jump;
+
+  upisenter(upis, &jump);
+  if (setjmp(jump)) {
+    return upisleave(upis, -1);
+  }
+  if (!reg || !registersets(reg)) {
+    upisfail(1, "No value named %s can be set",name);
+  }
+  if (reg->kind == UPIS_KIND_RELAY ? value != 0 && value != 1 : value < reg->min || value > reg->max) {
+    upisfail(1, "Invalid value %i for %s",value,reg->what);
+  }
+  planinit(&plan);
+  planwrite(&plan, reg->addr, reg->reg, value, reg->kind != UPIS_KIND_RELAY);
+  runplan(&plan);
+  if (reg->kind != UPIS_KIND_RELAY && planbyte(&plan, reg->addr, reg->reg) != value) {
+    upisfail(2, "%s reads back as %i rather than %i",reg->label,planbyte(&plan, reg->addr, reg->reg),value);
+  }
+  return upisleave(upis, 0);
+}
+
+int upisrunplan(struct upis *upis, struct upisplan *plan)
+{
+  jmp_buf jump;
+
+  upisenter(upis, &jump);
+  if (setjmp(jump)) {
+    return upisleave(upis, -1);
+  }
+  runplan(plan);
+  return upisleave(upis, 0);
+}
+
+const char *upiserror(const struct upis *upis)
+{
+  return upis ? upis->error : upismessage;
+}
+
+void upisclose(struct upis *upis)
+{
+  if (!upis) {
+    return;
+  }
+  upisenter(upis, NULL);
+  i2cclose();
+  upisleave(upis, 0);
+  free(upis);
+}
+
+/* Loads a session into the calling thread. Failures in the call return to jump, see upisfail */
+static void upisenter(struct upis *upis, jmp_buf *jump)
+{
+  i2c = upis->session;
+  picosim = upis->sim;
+  i2cdevice = upis->device;
+  i2ccache = NULL;
+  upisjump = jump;
+}
+
+/* Stores the session back, recording the failure when result is -1, and returns result.
+   A failure can leave the bus lock taken, so it is released */
+static int upisleave(struct upis *upis, int result)
+{
+  static const struct i2csession closed = { -1, 0, -1, 0, 0, NULL, -1, 0, 0 };
+
+  if (result < 0) {
+    snprintf(upis->error, sizeof(upis->error), "%s", upismessage);
+    if (i2c.locked > 0) {
+      i2c.locked = 1;
+      i2cunlock();
+    }
+  }
+  upis->session = i2c;
+  upis->sim = picosim;
+  i2c = closed;
+  upisjump = NULL;
+  return result;
+}
+
+/* Reports a failure. Within a library call the call returns -1 and upiserror gives the message;
+   otherwise the message is displayed as an error and the program exits with code, unless code is 0 */
+static void upisfail(int code, const char *format, ...)
+{
+  va_list args;
+
+  va_start(args, format);
+  if (upisjump) {
+    vsnprintf(upismessage, sizeof(upismessage), format, args);
+    va_end(args);
+    longjmp(*upisjump, 1);
+  }
+  printf("Error: ");
+  vprintf(format, args);
+  printf("\n");
+  va_end(args);
+  if (code) {
+    exit(code);
+  }
+}
+
+/* Returns the session descriptor for an I2C bus with the given slave address selected.
+   The bus is opened once and kept open; I2C_SLAVE is only issued when the address changes */
+static int i2copen(unsigned int i2cbus, unsigned int i2caddr)
+{
+  i2copenbus(i2cbus);
+  i2caddr = UPIS_DEVICE_ADDR(i2caddr);
+
+  if (i2c.addr != (int)i2caddr)
+  {
+    __atomic_fetch_add(&i2cstats.slaves, 1, __ATOMIC_RELAXED);
+    if (i2c.transport->slave(i2c.file, i2caddr) < 0)
+    {
+      /* Unable to read the PiCO interface */
+      upisfail(2, "Unable to access the PiCO interface at address 0x%02x",i2caddr);
+    }
+    i2c.addr = i2caddr;
+  }
+  return i2c.file;
+}
+
+/* Selects the transport used when the bus is next opened: "i2c-dev" or "sim[:LATENCY]".
+   Returns 0 if name is not a known transport */
+int i2cselect(const char *name)
+{
+  if (strcmp(name, "i2c-dev") == 0) {
+    i2c.transport = &i2cdevtransport;
+  } else if (strcmp(name, "sim") == 0 || strncmp(name, "sim:", 4) == 0) {
+    char *end = (char *)name + 3;
+
+    picosim.latency = 0;
+    picosim.errors = 0;
+    if (*end == ':') {
+      picosim.latency = strtol(end + 1, &end, 10);
+      if (*end == ':') {
+        picosim.errors = strtol(end + 1, &end, 10);
+      }
+      if (*end || picosim.latency < 0 || picosim.errors < 0 || picosim.errors > 1000) {
+        return 0;
+      }
+    }
+    i2c.transport = &simtransport;
+  } else {
+    return 0;
+  }
+  i2cclose();
+  return 1;
+}
+
+/* Turns on --stats accounting, starting the total wall time */
+void statsstart(void)
+{
+  i2cstats.enabled = 1;
+  i2cstats.thread = pthread_self();
+  clock_gettime(CLOCK_MONOTONIC, &i2cstats.start);
+  i2cstats.mark = i2cstats.start;
+}
+
+/* Ends the current stats section and starts the named one, or none when name is NULL.
+   Sections of the same name are added together */
+void statssection(const char *name)
+{
+  struct timespec now;
+  struct i2cstatsection *section;
+
+  if (!i2cstats.enabled || !pthread_equal(i2cstats.thread, pthread_self())) {
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (i2cstats.sections > 0) {
+    i2cstats.section[i2cstats.sections - 1].ns += elapsedns(&i2cstats.mark, &now);
+  }
+  i2cstats.mark = now;
+  if (!name) {
+    return;
+  }
+  if (i2cstats.sections > 0 && strcmp(i2cstats.section[i2cstats.sections - 1].name, name) == 0) {
+    return;
+  }
+  if (i2cstats.sections == I2C_STATS_SECTIONS) {
+    return;
+  }
+  section = &i2cstats.section[i2cstats.sections++];
+  memset(section, 0, sizeof(*section));
+  section->name = name;
+}
+
+/* Notes the start of a transaction, when --stats is on */
+static void statsclock(struct timespec *begin)
+{
+  if (i2cstats.enabled) {
+    clock_gettime(CLOCK_MONOTONIC, begin);
+  }
+}
+
+/* Accounts for a transaction that started at begin, at the given register, and moved the given number of bytes.
+   Transactions of other threads count towards the section the stats thread is in */
+static void statstransaction(const struct timespec *begin, unsigned int bytes, unsigned int i2caddr, unsigned int i2creg)
+{
+  struct timespec now;
+  long long ns;
+  long long max;
+
+  __atomic_fetch_add(&i2cstats.transactions, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&i2cstats.bytes, bytes, __ATOMIC_RELAXED);
+  if (!i2cstats.enabled) {
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ns = elapsedns(begin, &now);
+  __atomic_fetch_add(&i2cstats.busns, ns, __ATOMIC_RELAXED);
+  if (i2caddr >= 0x69 && i2caddr <= 0x6B && i2creg < I2C_LATENCY_REGS) {
+    __atomic_fetch_add(&i2cstats.latency[i2caddr - 0x69][i2creg][latencybucket(ns)], 1, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&i2cstats.latencymax[i2caddr - 0x69][i2creg], __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&i2cstats.latencymax[i2caddr - 0x69][i2creg], &max, ns, 0,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+  }
+  if (i2cstats.sections > 0) {
+    __atomic_fetch_add(&i2cstats.section[i2cstats.sections - 1].transactions, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&i2cstats.section[i2cstats.sections - 1].bytes, bytes, __ATOMIC_RELAXED);
+  }
+}
+
+/* Displays the --stats report on stderr */
+void statsreport(void)
+{
+  struct timespec now;
+  unsigned int counter;
+
+  statssection(NULL);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  fflush(stdout);
+  fprintf(stderr, "Bus opens: %lu\n", i2cstats.opens);
+  fprintf(stderr, "Slave address switches: %lu\n", i2cstats.slaves);
+  fprintf(stderr, "Transactions: %lu\n", i2cstats.transactions);
+  fprintf(stderr, "Bytes moved: %lu\n", i2cstats.bytes);
+  fprintf(stderr, "Time in transactions: %.3fms\n", i2cstats.busns / 1e6); /* Added up across threads */
+  fprintf(stderr, "Time waiting for the bus lock: %.3fms, %lu waits\n", i2cstats.lockns / 1e6, i2cstats.contended);
+  fprintf(stderr, "Transactions retried: %lu\n", i2cstats.retries);
+  for (counter = 0; counter < i2cstats.sections; counter++) {
+    fprintf(stderr, "Time in %s: %.3fms, %lu transactions, %lu bytes\n", i2cstats.section[counter].name,
+            i2cstats.section[counter].ns / 1e6, i2cstats.section[counter].transactions, i2cstats.section[counter].bytes);
+  }
+  fprintf(stderr, "Total time: %.3fms\n", elapsedns(&i2cstats.start, &now) / 1e6);
+}
+
+/* Returns the latency histogram bucket of a transaction taking ns nanoseconds */
+static int latencybucket(long long ns)
+{
+  unsigned long long us = ns > 0 ? ns / 1000 : 0;
+  int msb;
+  int bucket;
+
+  if (us < 8) {
+    return us;
+  }
+  msb = 63 - __builtin_clzll(us);
+  bucket = (msb - 2) * 8 + ((us >> (msb - 3)) & 7);
+  return bucket < I2C_LATENCY_BUCKETS ? bucket : I2C_LATENCY_BUCKETS - 1;
+}
+
+/* Returns the upper bound, in nanoseconds, of the bucket holding the given percentile of count transactions */
+static long long latencypercentile(const unsigned int *buckets, unsigned long count, int percent)
+{
+  unsigned long wanted = (count * percent + 99) / 100;
+  unsigned long seen = 0;
+  int bucket;
+
+  for (bucket = 0; bucket < I2C_LATENCY_BUCKETS - 1; bucket++) {
+    seen += buckets[bucket];
+    if (seen >= wanted) {
+      break;
+    }
+  }
+  bucket++;
+  if (bucket < 8) {
+    return bucket * 1000LL;
+  }
+  return ((long long)(8 + bucket % 8) << (bucket / 8 - 1)) * 1000LL;
+}
+
+/* Displays on stderr the p50, p99 and slowest latency of the transactions at each register */
+void latencyreport(void)
+{
+  unsigned long count;
+  long long p50;
+  long long p99;
+  long long max;
+  unsigned int page;
+  unsigned int reg;
+  int bucket;
+
+  fflush(stdout);
+  for (page = 0; page < 3; page++) {
+    for (reg = 0; reg < I2C_LATENCY_REGS; reg++) {
+      for (bucket = 0, count = 0; bucket < I2C_LATENCY_BUCKETS; bucket++) {
+        count += i2cstats.latency[page][reg][bucket];
+      }
+      if (!count) {
+        continue;
+      }
+      /* Bucket bounds can overshoot the slowest transaction seen */
+      max = i2cstats.latencymax[page][reg];
+      p50 = latencypercentile(i2cstats.latency[page][reg], count, 50);
+      p99 = latencypercentile(i2cstats.latency[page][reg], count, 99);
+      fprintf(stderr, "Latency at 0x%02x register 0x%02x: %lu transactions, p50 %.3fms, p99 %.3fms, max %.3fms\n", 0x69 + page, reg, count,
+              (p50 < max ? p50 : max) / 1e6, (p99 < max ? p99 : max) / 1e6, max / 1e6);
+    }
+  }
+}
+
+/* Waits before attempt number attempt + 2 at a failed transaction, between half and all of a backoff
+   that doubles with each attempt, so processes failing together do not retry in step.
+   Returns 0, without waiting, once the retries are used up */
+static int i2cbackoff(unsigned int attempt)
+{
+  struct timespec now;
+  struct timespec delay;
+  long backoff = I2C_RETRY_BACKOFF;
+
+  if (attempt >= i2cretries) {
+    return 0;
+  }
+  __atomic_fetch_add(&i2cstats.retries, 1, __ATOMIC_RELAXED);
+  while (attempt-- > 0 && backoff < I2C_RETRY_BACKOFF_MAX) {
+    backoff *= 2;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  backoff = backoff / 2 + now.tv_nsec / 1000 % (backoff / 2 + 1);
+  delay.tv_sec = backoff / 1000000;
+  delay.tv_nsec = (backoff % 1000000) * 1000;
+  while (nanosleep(&delay, &delay) < 0 && errno == EINTR) {
+  }
+  return 1;
+}
+
+/* Returns the nanoseconds from begin to end */
+long long elapsedns(const struct timespec *begin, const struct timespec *end)
+{
+  return (long long)(end->tv_sec - begin->tv_sec) * 1000000000LL + (end->tv_nsec - begin->tv_nsec);
+}
+
+/* Returns the session descriptor for an I2C bus, opening the bus if needed, without selecting a slave address */
+static int i2copenbus(unsigned int i2cbus)
+{
+  if (i2c.file >= 0 && i2c.bus != i2cbus)
+  {
+    /* Different bus requested, drop the current session */
+    i2cclose();
+  }
+
+  if (!i2c.transport)
+  {
+    i2c.transport = &i2cdevtransport;
+  }
+  if (i2c.file < 0)
+  {
+    __atomic_fetch_add(&i2cstats.opens, 1, __ATOMIC_RELAXED);
+    i2c.file = i2c.transport->open(i2cbus);
+    if (i2c.file < 0)
+    {
+      /* Unable to open I2C device */
+      upisfail(1, "Unable to open i2c bus %u",i2cbus);
+    }
+    i2c.bus = i2cbus;
+    i2c.addr = -1;
+    i2c.funcs = i2c.transport->funcs(i2c.file);
+    if ((i2ctimeout >= 0 || i2cadapterretries >= 0) && i2c.transport->limits(i2c.file, i2ctimeout, i2cadapterretries) < 0)
+    {
+      upisfail(1, "Unable to set the timeout or retries of i2c bus %u",i2cbus);
+    }
+    if (!i2c.registered)
+    {
+      atexit(i2cclose);
+      i2c.registered = 1;
+    }
+  }
+  return i2c.file;
+}
+
+/* Closes the I2C bus session, if one is open */
+void i2cclose(void)
+{
+  if (i2c.file >= 0)
+  {
+    i2c.transport->close(i2c.file);
+  }
+  i2c.file = -1;
+  i2c.addr = -1;
+  if (i2c.lock >= 0 && i2c.locked == 0)
+  {
+    close(i2c.lock);
+    i2c.lock = -1;
+  }
+}
+
+/* Takes the advisory lock of a bus, waiting up to i2clockwait milliseconds for other processes
+   to release it. Calls nest, only the outermost takes and releases the lock. flock wakes no waiter
+   in order, so a busy lock is retried at short jittered intervals, and holders keep it only for
+   their own transactions. Without a writable lock directory the bus is accessed unarbitrated */
+void i2clock(unsigned int i2cbus)
+{
+  struct timespec begin;
+  struct timespec now;
+  struct timespec delay;
+  char path[64];
+  long backoff = 50;
+
+  if (i2c.locked++ > 0)
+  {
+    return;
+  }
+  if (i2c.lock >= 0 && i2c.lockbus != i2cbus)
+  {
+    close(i2c.lock);
+    i2c.lock = -1;
+  }
+  if (i2c.lock < 0)
+  {
+    snprintf(path, sizeof(path), UPIS_LOCK_PATH, i2cbus);
+    i2c.lock = open(path, O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+    i2c.lockbus = i2cbus;
+  }
+  if (i2c.lock < 0 || flock(i2c.lock, LOCK_EX | LOCK_NB) == 0)
+  {
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  __atomic_fetch_add(&i2cstats.contended, 1, __ATOMIC_RELAXED);
+  while (flock(i2c.lock, LOCK_EX | LOCK_NB) < 0)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (elapsedns(&begin, &now) >= i2clockwait * 1000000LL)
+    {
+      upisfail(2, "i2c bus %u is busy, its lock was held for over %ldms",i2cbus,i2clockwait);
+    }
+    /* Between half and all of the backoff, so waiters started together drift apart */
+    delay.tv_sec = 0;
+    delay.tv_nsec = (backoff / 2 + now.tv_nsec % (backoff / 2 + 1)) * 1000;
+    nanosleep(&delay, NULL);
+    backoff = backoff * 2 > UPIS_LOCK_BACKOFF ? UPIS_LOCK_BACKOFF : backoff * 2;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  __atomic_fetch_add(&i2cstats.lockns, elapsedns(&begin, &now), __ATOMIC_RELAXED);
+}
+
+/* Releases the bus lock taken by the matching i2clock */
+void i2cunlock(void)
+{
+  if (--i2c.locked == 0 && i2c.lock >= 0)
+  {
+    flock(i2c.lock, LOCK_UN);
+  }
+}
+
+/* Procedure to read and retun an 8 bit (byte) integer from an I2C register at a given I2C address on a given I2C bus */
+int readi2cbyte(unsigned int i2cbus, unsigned int i2caddr, unsigned int i2creg)
+{
+  unsigned char cached[1];
+  if (readcache(i2caddr, i2creg, 1, cached)) {
+    return cached[0];
+  }
+
+  int i2cfile = i2copen(i2cbus, i2caddr);
+  __u8 i2c_register = i2creg; /* Device register to access */
+  __s32 i2cresult;
+  struct timespec begin;
+  unsigned int attempt = 0;
+
+  i2clock(i2cbus);
+  do {
+    statsclock(&begin);
+    i2cresult = i2c.transport->readbyte(i2cfile, i2c_register);
+    statstransaction(&begin, 2, i2caddr, i2creg);
+  } while (i2cresult < 0 && i2cbackoff(attempt++));
+  i2cunlock();
+  if (i2cresult < 0 )
+  {
+    upisfail(2, "Unexpected result: %i",i2cresult);
+  }
+  return i2cresult;
+}
+
+/* Procedure to read and retun an 16 bit (word) integer from an I2C register at a given I2C address on a given I2C bus */
+int readi2cword(unsigned int i2cbus, unsigned int i2caddr, unsigned int i2creg)
+{
+  unsigned char cached[2];
+  if (readcache(i2caddr, i2creg, 2, cached)) {
+    return cached[0] | (cached[1] << 8);
+  }
+
+  int i2cfile = i2copen(i2cbus, i2caddr);
+  __u8 i2c_register = i2creg; /* Device register to access */
+  __s32 i2cresult;
+  struct timespec begin;
+  unsigned int attempt = 0;
+
+  i2clock(i2cbus);
+  do {
+    statsclock(&begin);
+    i2cresult = i2c.transport->readword(i2cfile, i2c_register);
+    statstransaction(&begin, 3, i2caddr, i2creg);
+  } while (i2cresult < 0 && i2cbackoff(attempt++));
+  i2cunlock();
+  if (i2cresult < 0 )
+  {
+    upisfail(2, "Unexpected result: %i",i2cresult);
+  }
+  return i2cresult;
+}
+
+/* Procedure to read a block of consecutive 8 bit registers, starting at a given I2C register, in a single transaction.
+   Falls back to one byte read per register when the adapter cannot do I2C block reads */
+void readi2cblock(unsigned int i2cbus, unsigned int i2caddr, unsigned int i2creg, unsigned int i2clen, unsigned char *i2cbuf)
+{
+  if (readcache(i2caddr, i2creg, i2clen, i2cbuf)) {
+    return;
+  }
+
+  int i2cfile = i2copen(i2cbus, i2caddr);
+  __s32 i2cresult;
+  unsigned int counter;
+  struct timespec begin;
+  unsigned int attempt = 0;
+
+  if (!(i2c.funcs & I2C_FUNC_SMBUS_READ_I2C_BLOCK) || i2clen > I2C_SMBUS_BLOCK_MAX)
+  {
+    for (counter = 0; counter < i2clen; counter++)
+    {
+      i2cbuf[counter] = readi2cbyte(i2cbus, i2caddr, i2creg + counter);
+    }
+    return;
+  }
+
+  i2clock(i2cbus);
+  do {
+    statsclock(&begin);
+    i2cresult = i2c.transport->readblock(i2cfile, i2creg, i2clen, i2cbuf);
+    statstransaction(&begin, 1 + i2clen, i2caddr, i2creg);
+  } while (i2cresult != (__s32)i2clen && i2cbackoff(attempt++));
+  i2cunlock();
+  if (i2cresult != (__s32)i2clen)
+  {
+    upisfail(2, "Unexpected result: %i",i2cresult);
+  }
+}
+
+/* Adds a register range to a batch, to be read by readi2cbatch */
+static void i2cbatchadd(struct i2cbatch *batch, unsigned int i2caddr, unsigned int i2creg, unsigned int i2clen, unsigned char *i2cbuf)
+{
+  struct i2cbatchitem *item;
+
+  if (batch->count >= I2C_BATCH_MAX)
+  {
+    upisfail(2, "Too many register ranges in one batch");
+  }
+  item = &batch->items[batch->count++];
+  item->addr = i2caddr;
+  item->reg = i2creg;
+  item->len = i2clen;
+  item->buf = i2cbuf;
+}
+
+/* Procedure to read every register range of a batch with a single I2C_RDWR ioctl.
+   Ranges held by the cache are not read. Falls back to one block read per range
+   when the adapter cannot do plain I2C transfers */
+static void readi2cbatch(unsigned int i2cbus, struct i2cbatch *batch)
+{
+  struct i2c_msg msgs[I2C_BATCH_MAX * 2];
+  struct i2c_rdwr_ioctl_data rdwr;
+  struct i2cbatchitem *item;
+  struct timespec begin;
+  unsigned int counter;
+  unsigned int bytes;
+  unsigned int attempt = 0;
+  unsigned int first = batch->count; /* Item the transaction starts at, for the latency histogram */
+  unsigned int missed = 0;
+  unsigned char cached[I2C_BATCH_MAX];
+  int i2cfile;
+  int i2cresult;
+
+  /* The bus is only opened when the snapshot cannot serve every item */
+  for (counter = 0; counter < batch->count; counter++)
+  {
+    item = &batch->items[counter];
+    cached[counter] = readcache(item->addr, item->reg, item->len, item->buf);
+    missed += !cached[counter];
+  }
+  if (!missed)
+  {
+    return;
+  }
+  i2cfile = i2copenbus(i2cbus);
+
+  rdwr.msgs = msgs;
+  rdwr.nmsgs = 0;
+  for (counter = 0; counter < batch->count; counter++)
+  {
+    item = &batch->items[counter];
+    if (cached[counter])
+    {
+      continue;
+    }
+    if (!(i2c.funcs & I2C_FUNC_I2C))
+    {
+      readi2cblock(i2cbus, item->addr, item->reg, item->len, item->buf);
+      continue;
+    }
+    if (rdwr.nmsgs == 0)
+    {
+      first = counter;
+    }
+    msgs[rdwr.nmsgs].addr = UPIS_DEVICE_ADDR(item->addr);
+    msgs[rdwr.nmsgs].flags = 0;
+    msgs[rdwr.nmsgs].len = 1;
+    msgs[rdwr.nmsgs].buf = &item->reg;
+    rdwr.nmsgs++;
+    msgs[rdwr.nmsgs].addr = UPIS_DEVICE_ADDR(item->addr);
+    msgs[rdwr.nmsgs].flags = I2C_M_RD;
+    msgs[rdwr.nmsgs].len = item->len;
+    msgs[rdwr.nmsgs].buf = item->buf;
+    rdwr.nmsgs++;
+  }
+  if (rdwr.nmsgs == 0)
+  {
+    return;
+  }
+
+  for (counter = 0, bytes = 0; counter < rdwr.nmsgs; counter++)
+  {
+    bytes += msgs[counter].len;
+  }
+  i2clock(i2cbus);
+  do {
+    statsclock(&begin);
+    i2cresult = i2c.transport->rdwr(i2cfile, rdwr.msgs, rdwr.nmsgs);
+    statstransaction(&begin, bytes, batch->items[first].addr, batch->items[first].reg);
+  } while (i2cresult != (int)rdwr.nmsgs && i2cbackoff(attempt++));
+  i2cunlock();
+  if (i2cresult != (int)rdwr.nmsgs)
+  {
+    upisfail(2, "Unexpected result: %i",i2cresult);
+  }
+}
+
+/* Returns 1 when writing i2cval to a register carries out an action rather than setting a value,
+   such as 0xee to 0x69/0x07 resetting the PiCo, see UPIS_KIND_ACTION */
+static int writecommand(unsigned int i2caddr, unsigned int i2creg, unsigned int i2cval)
+{
+  unsigned int index;
+
+  for (index = 0; index < UPIS_REGISTERS; index++) {
+    if (upisregisters[index].kind == UPIS_KIND_ACTION && upisregisters[index].addr == i2caddr &&
+        upisregisters[index].reg == i2creg && upisregisters[index].min == (int)i2cval) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Procedure to write a 8 bit (byte) inetger to an I2C register at a giving I2C address on a given I2C bus */
+void writei2cbyte(unsigned int i2cbus, unsigned int i2caddr, unsigned int i2creg, unsigned int i2cval)
+{
+  /* Anything read after a write, such as the value set, must come from the PiCo itself */
+  i2ccache = NULL;
+
+  int i2cfile = i2copen(i2cbus, i2caddr);
+  __u8 i2c_register = i2creg; /* Device register to access */
+  __s32 i2cresult;
+  struct timespec begin;
+  unsigned int attempt = 0;
+  int retry = !writecommand(i2caddr, i2creg, i2cval);
+
+  /* A failed write may still have been applied, when the last byte was not acknowledged or the
+     transaction timed out after the PiCo took it. Setting a register again is harmless, so those
+     writes are retried, but commands such as a reset are sent only once */
+  i2clock(i2cbus);
+  do {
+    statsclock(&begin);
+    i2cresult = i2c.transport->writebyte(i2cfile, i2c_register, i2cval);
+    statstransaction(&begin, 2, i2caddr, i2creg);
+  } while (i2cresult < 0 && retry && i2cbackoff(attempt++));
+  i2cunlock();
+  if (i2cresult < 0 ) {
+    upisfail(0, "Unexpected result %i",i2cresult);
+  }
+}
+
+/* Reads the whole status page at 0x6A in one transaction and decodes it.
+   Words are transferred low byte first, as with an SMBus word read */
+void readstatus(struct upisstatus *status)
+{
+  unsigned char page[UPIS_STATUS_LEN];
+
+  readi2cblock(i2cdevice.bus,0x6A,0x00,UPIS_STATUS_LEN,page);
+  decodestatus(page, status);
+}
+
+/* Decodes a raw status page into a struct upisstatus */
+void decodestatus(const unsigned char *page, struct upisstatus *status)
+{
+  status->pwrsrc = page[0x00];
+  status->batvolt = bcdword2dec(page[0x01] | (page[0x02] << 8));
+  status->rpivolt = bcdword2dec(page[0x03] | (page[0x04] << 8));
+  status->usbvolt = bcdword2dec(page[0x05] | (page[0x06] << 8));
+  status->eprvolt = bcdword2dec(page[0x07] | (page[0x08] << 8));
+  status->current = bcdword2dec(page[0x09] | (page[0x0A] << 8));
+  status->centigrade = bcdbyte2dec(page[0x0B]);
+  status->fahrenheit = bcdword2dec(page[0x0C] | (page[0x0D] << 8));
+}
+
+/* Reads the RTC page at 0x69 in one transaction into a struct tm.
+   The seconds register is read again afterwards; if it has moved on, the page may have been
+   torn across a second/minute/day rollover, so it is fetched again */
+void readrtc(struct tm *rtc)
+{
+  unsigned char page[UPIS_RTC_LEN];
+
+  readrtcpage(page, UPIS_RTC_LEN);
+  decodertc(page, rtc);
+}
+
+/* Reads the first len registers of the RTC page with the seconds rollover check described above */
+void readrtcpage(unsigned char *page, unsigned int len)
+{
+  int retries = UPIS_RTC_RETRIES;
+
+  i2clock(i2cdevice.bus);
+  do {
+    readi2cblock(i2cdevice.bus,0x69,0x00,len,page);
+  } while (readi2cbyte(i2cdevice.bus,0x69,0x00) != page[0x00] && --retries > 0);
+  i2cunlock();
+}
+
+/* Decodes the BCD registers of a raw RTC page into a struct tm */
+void decodertc(const unsigned char *page, struct tm *rtc)
+{
+  memset(rtc, 0, sizeof(*rtc));
+  rtc->tm_sec = bcdbyte2dec(page[0x00]);
+  rtc->tm_min = bcdbyte2dec(page[0x01]);
+  rtc->tm_hour = bcdbyte2dec(page[0x02]);
+  rtc->tm_wday = bcdbyte2dec(page[0x03]) - 1;
+  rtc->tm_mday = bcdbyte2dec(page[0x04]);
+  rtc->tm_mon = bcdbyte2dec(page[0x05]) - 1;
+  rtc->tm_year = bcdbyte2dec(page[0x06]) + 100;
+  rtc->tm_isdst = -1;
+}
+
+/* Waits for the RTC seconds register to change and returns the RTC time it changed to, with the
+   CLOCK_MONOTONIC and CLOCK_REALTIME times of the change and the nanoseconds either side it may be
+   out by. The register is polled every UPIS_EDGE_COARSE to find roughly when it changes, then
+   continuously from just before it changes again, so the bus is only busy for a few milliseconds */
+#define UPIS_EDGE_COARSE 50000000LL
+#define UPIS_EDGE_LEAD 5000000LL
+time_t rtcedge(struct timespec *monotonic, struct timespec *realtime, long long *uncertainty)
+{
+  struct timespec coarse = { 0, UPIS_EDGE_COARSE };
+  struct timespec before;
+  struct timespec after;
+  struct timespec start;
+  struct timespec last;
+  struct timespec now;
+  struct tm rtc;
+  long long ns;
+  int attempt = 0;
+  int timed = 0;
+  int seconds;
+  int value;
+  int polls;
+
+  do {
+    if (attempt++ == UPIS_RTC_RETRIES) {
+      upisfail(2, "The RTC seconds did not change when expected, the bus may be too busy to time them");
+    }
+    seconds = readi2cbyte(i2cdevice.bus,0x69,0x00);
+    polls = 0;
+    do {
+      if (++polls > 2 * 1000000000LL / UPIS_EDGE_COARSE) {
+        upisfail(2, "The RTC is not running, its seconds did not change for 2 seconds");
+      }
+      nanosleep(&coarse, NULL);
+      clock_gettime(CLOCK_MONOTONIC, &before);
+      value = readi2cbyte(i2cdevice.bus,0x69,0x00);
+    } while (value == seconds);
+
+    /* The next change is due a second after the last poll that saw no change, at the earliest */
+    ns = before.tv_sec * 1000000000LL + before.tv_nsec + 1000000000LL - UPIS_EDGE_COARSE - UPIS_EDGE_LEAD;
+    start.tv_sec = ns / 1000000000LL;
+    start.tv_nsec = ns % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &start, NULL) == EINTR) {
+    }
+    i2clock(i2cdevice.bus);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    last = start;
+    seconds = readi2cbyte(i2cdevice.bus,0x69,0x00);
+    if (seconds != value) {
+      /* Woken too late, the change was missed */
+      i2cunlock();
+      continue;
+    }
+    do {
+      clock_gettime(CLOCK_MONOTONIC, &before);
+      value = readi2cbyte(i2cdevice.bus,0x69,0x00);
+      clock_gettime(CLOCK_MONOTONIC, &after);
+      if (value == seconds) {
+        last = before;
+      }
+    } while (value == seconds && elapsedns(&start, &after) < 2 * UPIS_EDGE_COARSE + 2 * UPIS_EDGE_LEAD);
+    if (value != seconds) {
+      readrtc(&rtc);
+      timed = rtc.tm_sec == bcdbyte2dec(value);
+    }
+    i2cunlock();
+  } while (!timed);
+
+  /* The change came after the last read of the old seconds began and before the first read of the new ended */
+  *uncertainty = elapsedns(&last, &after) / 2;
+  ns = last.tv_sec * 1000000000LL + last.tv_nsec + *uncertainty;
+  monotonic->tv_sec = ns / 1000000000LL;
+  monotonic->tv_nsec = ns % 1000000000LL;
+  clock_gettime(CLOCK_REALTIME, &now);
+  clock_gettime(CLOCK_MONOTONIC, &after);
+  ns = now.tv_sec * 1000000000LL + now.tv_nsec - elapsedns(monotonic, &after);
+  realtime->tv_sec = ns / 1000000000LL;
+  realtime->tv_nsec = ns % 1000000000LL;
+  return mktime(&rtc);
+}
+
+/* Sets the RTC, seconds first and the other registers straight after under the bus lock, so it
+   starts counting from the time given as soon as possible */
+void writertc(const struct tm *rtc)
+{
+  i2clock(i2cdevice.bus);
+  writei2cbyte(i2cdevice.bus,0x69,0x00,dec2bcdbyte(rtc->tm_sec));
+  writei2cbyte(i2cdevice.bus,0x69,0x01,dec2bcdbyte(rtc->tm_min));
+  writei2cbyte(i2cdevice.bus,0x69,0x02,dec2bcdbyte(rtc->tm_hour));
+  writei2cbyte(i2cdevice.bus,0x69,0x03,dec2bcdbyte(rtc->tm_wday + 1));
+  writei2cbyte(i2cdevice.bus,0x69,0x04,dec2bcdbyte(rtc->tm_mday));
+  writei2cbyte(i2cdevice.bus,0x69,0x05,dec2bcdbyte(rtc->tm_mon + 1));
+  writei2cbyte(i2cdevice.bus,0x69,0x06,dec2bcdbyte(rtc->tm_year % 100));
+  i2cunlock();
+}
+
+/* Reads the RTC, status and config pages and timestamps them */
+void readsnapshot(struct upissnapshot *snapshot)
+{
+  readpages(snapshot, UPIS_PAGE_ALL);
+}
+
+/* Reads the selected pages across all three addresses in one batch and timestamps them.
+   The RTC page gets the same seconds rollover check as readrtcpage */
+void readpages(struct upissnapshot *snapshot, int pages)
+{
+  struct i2cbatch batch;
+
+  batch.count = 0;
+  if (pages & UPIS_PAGE_RTC) {
+    i2cbatchadd(&batch,0x69,0x00,UPIS_RTCPAGE_LEN,snapshot->rtc);
+  }
+  if (pages & UPIS_PAGE_STATUS) {
+    i2cbatchadd(&batch,0x6A,0x00,UPIS_STATUS_LEN,snapshot->status);
+  }
+  if (pages & UPIS_PAGE_CONFIG) {
+    i2cbatchadd(&batch,0x6B,0x00,UPIS_CONFIG_LEN,snapshot->config);
+  }
+  i2clock(i2cdevice.bus);
+  readi2cbatch(i2cdevice.bus, &batch);
+  if ((pages & UPIS_PAGE_RTC) && readi2cbyte(i2cdevice.bus,0x69,0x00) != snapshot->rtc[0x00]) {
+    readrtcpage(snapshot->rtc, UPIS_RTCPAGE_LEN);
+  }
+  i2cunlock();
+  snapshot->pages = pages;
+  snapshot->bus = i2cdevice.bus;
+  snapshot->base = i2cdevice.base;
+  clock_gettime(CLOCK_MONOTONIC, &snapshot->monotonic);
+  clock_gettime(CLOCK_REALTIME, &snapshot->realtime);
+}
+
+/* Empties a plan */
+void planinit(struct upisplan *plan)
+{
+  memset(plan, 0, sizeof(*plan));
+}
+
+/* Adds registers to be read before any write. Registers already planned are only read once.
+   Queue the writes first, so reads depending on them are found */
+void planread(struct upisplan *plan, unsigned int i2caddr, unsigned int i2creg, unsigned int i2clen)
+{
+  unsigned int counter;
+
+  /* A range holding a register the plan writes is read after the writes, as its other registers
+     may depend on it, such as the IO pin value on the IO pin mode */
+  for (counter = 0; counter < plan->writes; counter++)
+  {
+    if (plan->write[counter].addr == i2caddr && plan->write[counter].reg >= i2creg && plan->write[counter].reg < i2creg + i2clen)
+    {
+      memset(&plan->verify[UPIS_PLAN_PAGE(i2caddr)][i2creg], 1, i2clen);
+      return;
+    }
+  }
+  memset(&plan->need[UPIS_PLAN_PAGE(i2caddr)][i2creg], 1, i2clen);
+}
+
+/* Queues a register write, optionally verified by reading the register back after all writes */
+void planwrite(struct upisplan *plan, unsigned int i2caddr, unsigned int i2creg, unsigned int i2cval, int verify)
+{
+  struct upisplanwrite *write;
+
+  if (plan->writes >= UPIS_PLAN_WRITES)
+  {
+    upisfail(2, "Too many register writes in one invocation");
+  }
+  write = &plan->write[plan->writes++];
+  write->addr = i2caddr;
+  write->reg = i2creg;
+  write->val = i2cval;
+  write->verify = verify;
+  if (verify)
+  {
+    plan->verify[UPIS_PLAN_PAGE(i2caddr)][i2creg] = 1;
+  }
+}
+
+/* Carries out a plan: one batch for all reads, the writes in order, one batch to read them back.
+   The bus lock is held throughout, so the values read back are those written */
+void runplan(struct upisplan *plan)
+{
+  unsigned int counter;
+  int rtcneeded = 0;
+
+  /* Reads the snapshot serves in full need neither the bus nor its lock */
+  if (!plan->writes && plancached(plan->need, plan->value))
+  {
+    statssection("read");
+    return;
+  }
+  i2clock(i2cdevice.bus);
+  statssection("read");
+  readplan(plan->need, plan->value);
+  for (counter = 0; counter < UPIS_RTC_LEN; counter++)
+  {
+    rtcneeded |= plan->need[UPIS_PLAN_PAGE(0x69)][counter];
+  }
+  if (rtcneeded && readi2cbyte(i2cdevice.bus,0x69,0x00) != plan->value[UPIS_PLAN_PAGE(0x69)][0x00])
+  {
+    /* Seconds rolled over during the batch, see readrtc */
+    readrtcpage(plan->value[UPIS_PLAN_PAGE(0x69)], UPIS_RTC_LEN);
+  }
+
+  statssection("write");
+  for (counter = 0; counter < plan->writes; counter++)
+  {
+    writei2cbyte(i2cdevice.bus, plan->write[counter].addr, plan->write[counter].reg, plan->write[counter].val);
+  }
+  statssection("verify");
+  readplan(plan->verify, plan->value);
+  i2cunlock();
+}
+
+/* Copies the marked registers of every address from the snapshot of the calling thread.
+   Returns 0 when the snapshot does not hold them all, see readcache */
+static int plancached(unsigned char marks[3][UPIS_PLAN_REGS], unsigned char value[3][UPIS_PLAN_REGS])
+{
+  unsigned int page;
+  unsigned int reg;
+
+  if (!i2ccache)
+  {
+    return 0;
+  }
+  for (page = 0; page < 3; page++)
+  {
+    for (reg = 0; reg < UPIS_PLAN_REGS; reg++)
+    {
+      if (marks[page][reg] && !readcache(0x69 + page, reg, 1, &value[page][reg]))
+      {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/* Reads the marked registers of every address with as few batch messages as possible,
+   merging ranges separated by up to UPIS_PLAN_GAP unmarked registers */
+void readplan(unsigned char marks[3][UPIS_PLAN_REGS], unsigned char value[3][UPIS_PLAN_REGS])
+{
+  struct i2cbatch batch;
+  unsigned int page;
+  unsigned int first;
+  unsigned int last;
+  unsigned int reg;
+
+  batch.count = 0;
+  for (page = 0; page < 3; page++)
+  {
+    reg = 0;
+    while (reg < UPIS_PLAN_REGS)
+    {
+      if (!marks[page][reg])
+      {
+        reg++;
+        continue;
+      }
+      first = last = reg;
+      for (reg = first + 1; reg < UPIS_PLAN_REGS && reg <= last + UPIS_PLAN_GAP + 1; reg++)
+      {
+        if (marks[page][reg])
+        {
+          last = reg;
+        }
+      }
+      if (batch.count == I2C_BATCH_MAX)
+      {
+        readi2cbatch(i2cdevice.bus, &batch);
+        batch.count = 0;
+      }
+      i2cbatchadd(&batch, 0x69 + page, first, last - first + 1, &value[page][first]);
+      reg = last + 1;
+    }
+  }
+  if (batch.count)
+  {
+    readi2cbatch(i2cdevice.bus, &batch);
+  }
+}
+
+/* Returns an 8 bit register value fetched by a plan */
+int planbyte(const struct upisplan *plan, unsigned int i2caddr, unsigned int i2creg)
+{
+  return plan->value[UPIS_PLAN_PAGE(i2caddr)][i2creg];
+}
+
+/* Returns a 16 bit register value fetched by a plan, low byte first as with an SMBus word read */
+int planword(const struct upisplan *plan, unsigned int i2caddr, unsigned int i2creg)
+{
+  return plan->value[UPIS_PLAN_PAGE(i2caddr)][i2creg] | (plan->value[UPIS_PLAN_PAGE(i2caddr)][i2creg + 1] << 8);
+}
+
+/* Decodes every value of a snapshot into fields, in option order. Returns the number of fields */
+int snapshotfields(const struct upissnapshot *snapshot, struct upisfield *fields)
+{
+  const struct upisregister *reg;
+  const unsigned char *page;
+  unsigned int index;
+  struct tm rtc;
+  int count = 0;
+  int value;
+
+  fields[count].name = "time"; fields[count].isstring = 0;
+  snprintf(fields[count++].value, 32, "%lld.%03ld", (long long)snapshot->realtime.tv_sec, snapshot->realtime.tv_nsec / 1000000);
+  fields[count].name = "bus"; fields[count].isstring = 0;
+  snprintf(fields[count++].value, 32, "%u", snapshot->bus);
+  fields[count].name = "address"; fields[count].isstring = 1;
+  snprintf(fields[count++].value, 32, "0x%02x", snapshot->base);
+  for (index = 0; index < UPIS_REGISTERS; index++) {
+    reg = &upisregisters[index];
+    if (reg->kind == UPIS_KIND_ACTION || reg->kind == UPIS_KIND_TODO) {
+      continue;
+    }
+    page = registerpage(snapshot, reg->addr);
+    value = registervalue(reg, page);
+    fields[count].name = reg->name;
+    fields[count].isstring = reg->kind == UPIS_KIND_RTC || reg->kind == UPIS_KIND_PWRSRC;
+    if (reg->kind == UPIS_KIND_RTC) {
+      decodertc(page, &rtc);
+      strftime(fields[count].value, 32, "%Y-%m-%dT%H:%M:%S", &rtc);
+    } else if (reg->kind == UPIS_KIND_PWRSRC) {
+      snprintf(fields[count].value, 32, "%s", pwrsrcname(value));
+    } else if (value < 0) {
+      snprintf(fields[count].value, 32, "null");
+    } else {
+      snprintf(fields[count].value, 32, "%g", (double)value / reg->scale);
+    }
+    count++;
+  }
+  return count;
+}
+
+/* Returns the descriptor of the value named name, NULL if there is none */
+const struct upisregister *registerfind(const char *name)
+{
+  unsigned int index;
+
+  for (index = 0; index < UPIS_REGISTERS; index++) {
+    if (strcmp(upisregisters[index].name, name) == 0) {
+      return &upisregisters[index];
+    }
+  }
+  return NULL;
+}
+
+/* Returns the registers of a snapshot for a PiCo address, indexed by register number */
+const unsigned char *registerpage(const struct upissnapshot *snapshot, unsigned int i2caddr)
+{
+  switch (i2caddr) {
+    case 0x69: return snapshot->rtc;
+    case 0x6A: return snapshot->status;
+    default: return snapshot->config;
+  }
+}
+
+/* Decodes a value from the registers of its address, indexed by register number.
+   Returns -1 for an IO value when the IO mode is not set */
+int registervalue(const struct upisregister *reg, const unsigned char *page)
+{
+  switch (reg->kind) {
+    case UPIS_KIND_BCD:
+      return bcdbyte2dec(page[reg->reg]);
+    case UPIS_KIND_BCDWORD:
+      return bcdword2dec(page[reg->reg] | (page[reg->reg + 1] << 8));
+    case UPIS_KIND_WORD:
+      return page[reg->reg] | (page[reg->reg + 1] << 8);
+    case UPIS_KIND_IOVALUE:
+      switch (page[reg->reg]) {
+        case 1: return page[reg->reg + 1] | (page[reg->reg + 2] << 8); /* 1 wire temp value (word) */
+        case 2:                                                         /* 8 bit A/D value (byte) */
+        case 3: return page[reg->reg + 1];                              /* Status of forced on-change (byte?) */
+        default: return -1;
+      }
+    default:
+      return page[reg->reg];
+  }
+}
+
+/* Returns 1 when the argument of a register option is a value to set */
+int registersets(const struct upisregister *reg)
+{
+  return reg->arg && (reg->kind == UPIS_KIND_BYTE || reg->kind == UPIS_KIND_RELAY);
+}
+
+/* Returns the short name of a power source, as displayed by -s -v in brackets */
+const char *pwrsrcname(int pwrsrc)
+{
+  switch (pwrsrc) {
+    case 1: return "EPR";
+    case 2: return "USB";
+    case 3: return "RPI";
+    case 4: return "BAT";
+    case 5: return "LPR";
+    case 6: return "CPR";
+    case 7: return "BPR";
+  }
+  return "unknown";
+}
+
+/* Copies registers from the cached snapshot, if there is one and it holds all of them.
+   Returns 1 when the registers were served from the cache, 0 when they must be read from the bus */
+static int readcache(unsigned int i2caddr, unsigned int i2creg, unsigned int i2clen, unsigned char *i2cbuf)
+{
+  const unsigned char *page;
+  unsigned int pagelen;
+
+  if (!i2ccache) {
+    return 0;
+  }
+  if (i2caddr == 0x69 && (i2ccache->pages & UPIS_PAGE_RTC)) {
+    page = i2ccache->rtc; pagelen = UPIS_RTCPAGE_LEN;
+  } else if (i2caddr == 0x6A && (i2ccache->pages & UPIS_PAGE_STATUS)) {
+    page = i2ccache->status; pagelen = UPIS_STATUS_LEN;
+  } else if (i2caddr == 0x6B && (i2ccache->pages & UPIS_PAGE_CONFIG)) {
+    page = i2ccache->config; pagelen = UPIS_CONFIG_LEN;
+  } else {
+    return 0;
+  }
+  if (i2creg + i2clen > pagelen) {
+    return 0;
+  }
+  memcpy(i2cbuf, page + i2creg, i2clen);
+  return 1;
+}
+
+/* Reads of the sequence a reader makes while a snapshot is being published before it gives up
+   and reads the bus, so readers of a upisd killed part way through publishing do not hang */
+#define UPIS_SHM_SPINS 100000
+
+/* Snapshot file mapped by shmread for the calling thread, see shmmap */
+struct shmmapping {
+  char path[256];
+  const struct upisshm *shm;  /* NULL when nothing is mapped */
+  dev_t dev;                  /* File the mapping belongs to */
+  ino_t ino;
+};
+static __thread struct shmmapping shmmapped;
+
+/* Creates, or reopens, the shared snapshot file and maps it for publishing */
+struct upisshm *shmcreate(const char *path)
+{
+  struct upisshm *shm;
+  int shmfile;
+
+  shmfile = open(path, O_RDWR | O_CREAT, 0644);
+  if (shmfile < 0 || ftruncate(shmfile, sizeof(struct upisshm)) < 0)
+  {
+    upisfail(1, "Unable to create snapshot file %s",path);
+  }
+  shm = mmap(NULL, sizeof(struct upisshm), PROT_READ | PROT_WRITE, MAP_SHARED, shmfile, 0);
+  close(shmfile);
+  if (shm == MAP_FAILED)
+  {
+    upisfail(1, "Unable to map snapshot file %s",path);
+  }
+  return shm;
+}
+
+/* Publishes a snapshot under the seqlock: the sequence is odd while the copy is in progress,
+   so readers that see an odd or changed sequence know to retry */
+void shmpublish(struct upisshm *shm, const struct upissnapshot *snapshot)
+{
+  unsigned int seq = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(&shm->snapshot, snapshot, sizeof(*snapshot));
+  __atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&shm->magic, UPIS_SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+/* Maps the snapshot file at path for the calling thread. The mapping is kept for later calls and
+   only looked up again when check is set, then replaced when path names another file. Returns
+   NULL when there is no snapshot file */
+static const struct upisshm *shmmap(const char *path, int check)
+{
+  const struct upisshm *shm;
+  struct stat shmstat;
+  int shmfile;
+
+  if (shmmapped.shm && strcmp(path, shmmapped.path) == 0) {
+    if (!check) {
+      return shmmapped.shm;
+    }
+    if (stat(path, &shmstat) == 0 && shmstat.st_dev == shmmapped.dev && shmstat.st_ino == shmmapped.ino) {
+      return shmmapped.shm;
+    }
+  }
+  if (shmmapped.shm) {
+    munmap((void *)shmmapped.shm, sizeof(struct upisshm));
+    shmmapped.shm = NULL;
+  }
+  if (strlen(path) >= sizeof(shmmapped.path)) {
+    return NULL;
+  }
+  shmfile = open(path, O_RDONLY | O_CLOEXEC);
+  if (shmfile < 0) {
+    return NULL;
+  }
+  if (fstat(shmfile, &shmstat) < 0 || shmstat.st_size < (off_t)sizeof(struct upisshm)) {
+    close(shmfile);
+    return NULL;
+  }
+  shm = mmap(NULL, sizeof(struct upisshm), PROT_READ, MAP_SHARED, shmfile, 0);
+  close(shmfile);
+  if (shm == MAP_FAILED) {
+    return NULL;
+  }
+  strcpy(shmmapped.path, path);
+  shmmapped.shm = shm;
+  shmmapped.dev = shmstat.st_dev;
+  shmmapped.ino = shmstat.st_ino;
+  return shm;
+}
+
+/* Copies the snapshot out of a mapping under the seqlock. Returns 0 when nothing is published,
+   or when a publication stays in progress for UPIS_SHM_SPINS reads of the sequence */
+static int shmcopy(const struct upisshm *shm, struct upissnapshot *snapshot)
+{
+  unsigned int spins = 0;
+  unsigned int seq;
+
+  if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != UPIS_SHM_MAGIC) {
+    return 0;
+  }
+  do {
+    while ((seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE)) & 1) {
+      /* Writer in progress, or killed part way through */
+      if (++spins >= UPIS_SHM_SPINS) {
+        return 0;
+      }
+    }
+    memcpy(snapshot, &shm->snapshot, sizeof(*snapshot));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != seq && ++spins < UPIS_SHM_SPINS);
+  return spins < UPIS_SHM_SPINS;
+}
+
+/* Copies the snapshot published at path if it is no older than maxage milliseconds.
+   Never touches the bus, and once the file is mapped makes no system call while upisd keeps
+   publishing. Returns 1 on success, 0 when there is no usable snapshot */
+int shmread(const char *path, long maxage, struct upissnapshot *snapshot)
+{
+  const struct upisshm *shm;
+  struct timespec now;
+  long age;
+  int check;
+
+  /* An unusable snapshot may be the file of an earlier upisd, so it is looked up again once */
+  for (check = 0; check < 2; check++) {
+    shm = shmmap(path, check);
+    if (!shm) {
+      return 0;
+    }
+    if (shmcopy(shm, snapshot)) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      age = (now.tv_sec - snapshot->monotonic.tv_sec) * 1000 + (now.tv_nsec - snapshot->monotonic.tv_nsec) / 1000000;
+      if (age >= 0 && age <= maxage) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* Reads the header of an open history file. Returns 1 when it is a history file of the current
+   record layout and exactly as long as its header says, so all of it can be mapped without a
+   truncated or replaced file raising SIGBUS on access */
+static int ringvalid(int ringfile, struct upisringhead *head)
+{
+  struct stat ringstat;
+
+  if (pread(ringfile, head, sizeof(*head), 0) != sizeof(*head) || head->magic != UPIS_RING_MAGIC ||
+      head->size != sizeof(struct upisrecord) || head->records == 0 ||
+      (uint64_t)head->records * sizeof(struct upisrecord) > SIZE_MAX - sizeof(*head) || fstat(ringfile, &ringstat) < 0) {
+    return 0;
+  }
+  return ringstat.st_size == (off_t)(sizeof(*head) + (uint64_t)head->records * sizeof(struct upisrecord));
+}
+
+/* Opens the history file at path and maps it for appending, creating it with room for records
+   records when it does not exist, was written with a different record layout or is not the
+   length its header gives */
+void ringcreate(struct upisring *ring, const char *path, unsigned int records)
+{
+  struct upisringhead head;
+  int ringfile;
+
+  ringfile = open(path, O_RDWR | O_CREAT, 0644);
+  if (ringfile < 0)
+  {
+    upisfail(1, "Unable to create history file %s",path);
+  }
+  if (!ringvalid(ringfile, &head)) {
+    memset(&head, 0, sizeof(head));
+    head.size = sizeof(struct upisrecord);
+    head.records = records;
+    if (ftruncate(ringfile, 0) < 0 || ftruncate(ringfile, sizeof(head) + (off_t)records * sizeof(struct upisrecord)) < 0 ||
+        pwrite(ringfile, &head, sizeof(head), 0) != sizeof(head))
+    {
+      upisfail(1, "Unable to create history file %s",path);
+    }
+  }
+  ring->length = sizeof(head) + (size_t)head.records * sizeof(struct upisrecord);
+  ring->head = mmap(NULL, ring->length, PROT_READ | PROT_WRITE, MAP_SHARED, ringfile, 0);
+  close(ringfile);
+  if (ring->head == MAP_FAILED)
+  {
+    upisfail(1, "Unable to map history file %s",path);
+  }
+  ring->record = (struct upisrecord *)(ring->head + 1);
+  ring->pending = 0;
+  ring->head->magic = UPIS_RING_MAGIC;
+}
+
+/* Queues the status page of a snapshot as a record. Records only reach the file, and so the
+   flash, when the queue is full or on ringflush */
+void ringappend(struct upisring *ring, const struct upissnapshot *snapshot)
+{
+  struct upisrecord *record = &ring->buffer[ring->pending++];
+  struct upisstatus status;
+
+  decodestatus(snapshot->status, &status);
+  memset(record, 0, sizeof(*record));
+  record->time = (int64_t)snapshot->realtime.tv_sec * 1000 + snapshot->realtime.tv_nsec / 1000000;
+  record->value[0] = status.batvolt;
+  record->value[1] = status.rpivolt;
+  record->value[2] = status.usbvolt;
+  record->value[3] = status.eprvolt;
+  record->value[4] = status.current;
+  record->value[5] = status.centigrade;
+  record->value[6] = status.fahrenheit;
+  record->pwrsrc = status.pwrsrc;
+  if (ring->pending == UPIS_RING_PENDING) {
+    ringflush(ring);
+  }
+}
+
+/* Copies the queued records into the ring and writes the dirty pages out in one msync.
+   The count of records is advanced only after they are in place, so readers never see a partial record */
+void ringflush(struct upisring *ring)
+{
+  uint64_t next = ring->head->next;
+  unsigned int counter;
+
+  if (!ring->pending) {
+    return;
+  }
+  for (counter = 0; counter < ring->pending; counter++) {
+    ring->record[(next + counter) % ring->head->records] = ring->buffer[counter];
+  }
+  __atomic_store_n(&ring->head->next, next + ring->pending, __ATOMIC_RELEASE);
+  ring->pending = 0;
+  msync(ring->head, ring->length, MS_SYNC);
+}
+
+/* Summarises the records of the history file at path timed from from to to milliseconds inclusive.
+   The file is mapped rather than read, and the first record in range is found by a binary search,
+   so only the pages holding the range are loaded. Records are assumed to be in time order, a clock
+   stepped back leaves the records before the step out of range. Returns 0 when there is no history */
+int ringquery(const char *path, int64_t from, int64_t to, struct upishistory *history)
+{
+  const struct upisringhead *head;
+  const struct upisrecord *record;
+  struct upisringhead header;
+  uint64_t next, oldest, low, high, index;
+  size_t length;
+  int ringfile;
+  int counter;
+
+  memset(history, 0, sizeof(*history));
+  ringfile = open(path, O_RDONLY);
+  if (ringfile < 0) {
+    return 0;
+  }
+  if (!ringvalid(ringfile, &header)) {
+    close(ringfile);
+    return 0;
+  }
+  length = sizeof(header) + (size_t)header.records * sizeof(struct upisrecord);
+  head = mmap(NULL, length, PROT_READ, MAP_SHARED, ringfile, 0);
+  close(ringfile);
+  if (head == MAP_FAILED) {
+    return 0;
+  }
+  record = (const struct upisrecord *)(head + 1);
+
+  next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+  oldest = next > header.records ? next - header.records : 0;
+  low = oldest;
+  high = next;
+  while (low < high) {
+    index = low + (high - low) / 2;
+    if (record[index % header.records].time < from) {
+      low = index + 1;
+    } else {
+      high = index;
+    }
+  }
+  for (index = low; index < next && record[index % header.records].time <= to; index++) {
+    const struct upisrecord *current = &record[index % header.records];
+
+    if (!history->count) {
+      history->first = current->time;
+      for (counter = 0; counter < UPIS_RING_VALUES; counter++) {
+        history->min[counter] = current->value[counter];
+        history->max[counter] = current->value[counter];
+      }
+    }
+    history->last = current->time;
+    for (counter = 0; counter < UPIS_RING_VALUES; counter++) {
+      if (current->value[counter] < history->min[counter]) {
+        history->min[counter] = current->value[counter];
+      }
+      if (current->value[counter] > history->max[counter]) {
+        history->max[counter] = current->value[counter];
+      }
+      history->sum[counter] += current->value[counter];
+    }
+    history->pwrsrc[current->pwrsrc < 8 ? current->pwrsrc : 0]++;
+    history->count++;
+  }
+  munmap((void *)head, length);
+  return 1;
+}
+
+/* Carries out jobs with one thread per bus, so separate buses are accessed concurrently while
+   the devices of each bus are accessed in turn. Returns once every job is done */
+void runjobs(struct upisjob *jobs, unsigned int count)
+{
+  struct upisworker workers[UPIS_DEVICES];
+  unsigned int nworkers = 0;
+  unsigned int counter;
+  unsigned int index;
+
+  statssection("buses");
+  for (counter = 0; counter < count; counter++) {
+    for (index = 0; index < nworkers && workers[index].bus != jobs[counter].device.bus; index++) {
+    }
+    if (index < nworkers) {
+      continue;
+    }
+    workers[nworkers].bus = jobs[counter].device.bus;
+    workers[nworkers].transport = i2c.transport;
+    workers[nworkers].latency = picosim.latency;
+    workers[nworkers].errors = picosim.errors;
+    workers[nworkers].jobs = jobs;
+    workers[nworkers].count = count;
+    if (pthread_create(&workers[nworkers].thread, NULL, runworker, &workers[nworkers]) != 0) {
+      upisfail(1, "Unable to start a thread for i2c bus %u",jobs[counter].device.bus);
+    }
+    nworkers++;
+  }
+  for (index = 0; index < nworkers; index++) {
+    pthread_join(workers[index].thread, NULL);
+  }
+}
+
+/* Thread body of runjobs: carries out the jobs of one bus in order on a session of its own */
+static void *runworker(void *data)
+{
+  struct upisworker *worker = data;
+  unsigned int counter;
+
+  i2c.transport = worker->transport;
+  i2c.registered = 1; /* Closed below rather than at exit */
+  picosim.latency = worker->latency;
+  picosim.errors = worker->errors;
+  for (counter = 0; counter < worker->count; counter++) {
+    if (worker->jobs[counter].device.bus != worker->bus) {
+      continue;
+    }
+    i2cdevice = worker->jobs[counter].device;
+    if (worker->jobs[counter].all) {
+      readsnapshot(&worker->jobs[counter].snapshot);
+    } else {
+      runplan(&worker->jobs[counter].plan);
+    }
+  }
+  i2cclose();
+  return NULL;
+}
+
+/* i2c-dev transport: the kernel I2C character device */
+static int devopen(unsigned int i2cbus)
+{
+  char i2cdev[20];
+
+  snprintf(i2cdev, 19, "/dev/i2c-%d", i2cbus);
+  return open(i2cdev, O_RDWR | O_CLOEXEC);
+}
+
+static void devclose(int file)
+{
+  close(file);
+}
+
+static unsigned long devfuncs(int file)
+{
+  unsigned long funcs;
+
+  if (ioctl(file, I2C_FUNCS, &funcs) < 0) {
+    return 0;
+  }
+  return funcs;
+}
+
+static int devslave(int file, unsigned int i2caddr)
+{
+  return ioctl(file, I2C_SLAVE, i2caddr);
+}
+
+static int devreadbyte(int file, unsigned int i2creg)
+{
+  return i2c_smbus_read_byte_data(file, i2creg);
+}
+
+static int devreadword(int file, unsigned int i2creg)
+{
+  return i2c_smbus_read_word_data(file, i2creg);
+}
+
+static int devwritebyte(int file, unsigned int i2creg, unsigned int i2cval)
+{
+  return i2c_smbus_write_byte_data(file, i2creg, i2cval);
+}
+
+static int devreadblock(int file, unsigned int i2creg, unsigned int i2clen, unsigned char *i2cbuf)
+{
+  return i2c_smbus_read_i2c_block_data(file, i2creg, i2clen, i2cbuf);
+}
+
+static int devrdwr(int file, struct i2c_msg *msgs, unsigned int nmsgs)
+{
+  struct i2c_rdwr_ioctl_data rdwr;
+
+  rdwr.msgs = msgs;
+  rdwr.nmsgs = nmsgs;
+  return ioctl(file, I2C_RDWR, &rdwr);
+}
+
+static int devlimits(int file, int timeout, int retries)
+{
+  /* The adapter counts its timeout in units of 10ms */
+  if (timeout >= 0 && ioctl(file, I2C_TIMEOUT, (timeout + 9) / 10) < 0) {
+    return -1;
+  }
+  if (retries >= 0 && ioctl(file, I2C_RETRIES, retries) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/* sim transport: models the PiCo register map of 0x69 (RTC), 0x6A (status) and 0x6B (config)
+   in memory, including the BCD encodings, so every code path can run without a UPiS */
+static int simopen(unsigned int i2cbus)
+{
+  if (!picosim.ready) {
+    simreset(1);
+    picosim.ready = 1;
+    picosim.timeout = -1;
+    picosim.seed = time(NULL) ^ getpid() ^ i2cbus;
+  }
+  picosim.addr = -1;
+  return 0;
+}
+
+static void simclose(int file)
+{
+}
+
+static unsigned long simfuncs(int file)
+{
+  return I2C_FUNC_I2C | I2C_FUNC_SMBUS_BYTE_DATA | I2C_FUNC_SMBUS_WORD_DATA | I2C_FUNC_SMBUS_READ_I2C_BLOCK;
+}
+
+static int simslave(int file, unsigned int i2caddr)
+{
+  if (i2caddr < i2cdevice.base || i2caddr > i2cdevice.base + 2) {
+    errno = ENXIO;
+    return -1;
+  }
+  picosim.addr = i2caddr - i2cdevice.base + 0x69;
+  return 0;
+}
+
+static int simreadbyte(int file, unsigned int i2creg)
+{
+  if (simdelay() < 0) {
+    return -1;
+  }
+  return simread(picosim.addr, i2creg);
+}
+
+static int simreadword(int file, unsigned int i2creg)
+{
+  int low;
+  int high;
+
+  if (simdelay() < 0) {
+    return -1;
+  }
+  low = simread(picosim.addr, i2creg);
+  high = simread(picosim.addr, i2creg + 1);
+  if (low < 0 || high < 0) {
+    return -1;
+  }
+  return low | (high << 8);
+}
+
+static int simwritebyte(int file, unsigned int i2creg, unsigned int i2cval)
+{
+  if (simdelay() < 0) {
+    return -1;
+  }
+  return simwrite(picosim.addr, i2creg, i2cval);
+}
+
+static int simreadblock(int file, unsigned int i2creg, unsigned int i2clen, unsigned char *i2cbuf)
+{
+  unsigned int counter;
+  int i2cresult;
+
+  if (simdelay() < 0) {
+    return -1;
+  }
+  for (counter = 0; counter < i2clen; counter++) {
+    i2cresult = simread(picosim.addr, i2creg + counter);
+    if (i2cresult < 0) {
+      return -1;
+    }
+    i2cbuf[counter] = i2cresult;
+  }
+  return i2clen;
+}
+
+static int simlimits(int file, int timeout, int retries)
+{
+  if (timeout >= 0) {
+    picosim.timeout = timeout;
+  }
+  return 0;
+}
+
+/* Plain I2C messages: a write sets the register pointer of the address, any further bytes are
+   written from there; a read returns registers from the pointer on, both auto incrementing */
+static int simrdwr(int file, struct i2c_msg *msgs, unsigned int nmsgs)
+{
+  unsigned int counter;
+  unsigned int index;
+  unsigned int page;
+  int i2cresult;
+
+  if (simdelay() < 0) {
+    return -1;
+  }
+  for (counter = 0; counter < nmsgs; counter++) {
+    if (msgs[counter].addr < i2cdevice.base || msgs[counter].addr > i2cdevice.base + 2) {
+      errno = ENXIO;
+      return -1;
+    }
+    page = msgs[counter].addr - i2cdevice.base;
+    for (index = 0; index < msgs[counter].len; index++) {
+      if (msgs[counter].flags & I2C_M_RD) {
+        i2cresult = simread(0x69 + page, picosim.pointer[page]++);
+        if (i2cresult < 0) {
+          return -1;
+        }
+        msgs[counter].buf[index] = i2cresult;
+      } else if (index == 0) {
+        picosim.pointer[page] = msgs[counter].buf[0];
+      } else if (simwrite(0x69 + page, picosim.pointer[page]++, msgs[counter].buf[index]) < 0) {
+        return -1;
+      }
+    }
+  }
+  return nmsgs;
+}
+
+/* Returns a simulated register, refreshing the RTC from the clock when it is read */
+static int simread(unsigned int i2caddr, unsigned int i2creg)
+{
+  struct tm rtc;
+  time_t now;
+
+  if (i2caddr < 0x69 || i2caddr > 0x6B || i2creg >= PICOSIM_REGS) {
+    errno = EIO;
+    return -1;
+  }
+  if (i2caddr == 0x69 && i2creg < UPIS_RTC_LEN) {
+    now = simclock() + picosim.rtcoffset;
+    localtime_r(&now, &rtc);
+    picosim.regs[0][0x00] = dec2bcdbyte(rtc.tm_sec);
+    picosim.regs[0][0x01] = dec2bcdbyte(rtc.tm_min);
+    picosim.regs[0][0x02] = dec2bcdbyte(rtc.tm_hour);
+    picosim.regs[0][0x03] = dec2bcdbyte(rtc.tm_wday + 1);
+    picosim.regs[0][0x04] = dec2bcdbyte(rtc.tm_mday);
+    picosim.regs[0][0x05] = dec2bcdbyte(rtc.tm_mon + 1);
+    picosim.regs[0][0x06] = dec2bcdbyte(rtc.tm_year % 100);
+  }
+  return picosim.regs[i2caddr - 0x69][i2creg];
+}
+
+/* Stores a simulated register, acting on the commands written to the RTC factor register */
+static int simwrite(unsigned int i2caddr, unsigned int i2creg, unsigned int i2cval)
+{
+  struct tm rtc;
+
+  if (i2caddr < 0x69 || i2caddr > 0x6B || i2creg >= PICOSIM_REGS) {
+    errno = EIO;
+    return -1;
+  }
+  if (i2caddr == 0x69 && i2creg < UPIS_RTC_LEN) {
+    /* Setting the clock moves the offset from the system clock */
+    simread(i2caddr, i2creg);
+    picosim.regs[0][i2creg] = i2cval;
+    decodertc(picosim.regs[0], &rtc);
+    picosim.rtcoffset = mktime(&rtc) - simclock();
+    return 0;
+  }
+  if (i2caddr == 0x69 && i2creg == 0x07) {
+    switch (i2cval) {
+      case 0xdd: simreset(1); return 0;   /* Factory reset */
+      case 0xee: simreset(0); return 0;   /* CPU reset */
+      case 0xff: return 0;                /* Bootloader, nothing to model */
+    }
+  }
+  picosim.regs[i2caddr - 0x69][i2creg] = i2cval;
+  return 0;
+}
+
+/* Puts the simulated PiCo in its power on state: running from EPR, RTC reset to 01/01/2012.
+   A factory reset also restores the default configuration */
+static void simreset(int factory)
+{
+  struct tm rtc;
+
+  memset(&rtc, 0, sizeof(rtc));
+  rtc.tm_mday = 1;
+  rtc.tm_year = 112;
+  rtc.tm_isdst = -1;
+  picosim.rtcoffset = picosim.ready ? mktime(&rtc) - simclock() : 0;
+
+  picosim.regs[1][0x00] = 1;                       /* EPR */
+  picosim.regs[1][0x01] = dec2bcdword(412) & 0xFF; /* BAT 4.12V */
+  picosim.regs[1][0x02] = dec2bcdword(412) >> 8;
+  picosim.regs[1][0x03] = dec2bcdword(508) & 0xFF; /* RPI 5.08V */
+  picosim.regs[1][0x04] = dec2bcdword(508) >> 8;
+  picosim.regs[1][0x05] = 0;                       /* USB 0V */
+  picosim.regs[1][0x06] = 0;
+  picosim.regs[1][0x07] = dec2bcdword(1210) & 0xFF; /* EPR 12.10V */
+  picosim.regs[1][0x08] = dec2bcdword(1210) >> 8;
+  picosim.regs[1][0x09] = dec2bcdword(450) & 0xFF; /* 450mA */
+  picosim.regs[1][0x0A] = dec2bcdword(450) >> 8;
+  picosim.regs[1][0x0B] = dec2bcdbyte(25);         /* 25C */
+  picosim.regs[1][0x0C] = dec2bcdword(77) & 0xFF;  /* 77F */
+  picosim.regs[1][0x0D] = dec2bcdword(77) >> 8;
+
+  if (factory) {
+    picosim.regs[0][0x07] = 0;     /* RTC correction factor */
+    picosim.regs[2][0x00] = 0x32;  /* Firmware version */
+    picosim.regs[2][0x01] = 0x00;  /* Last error */
+    picosim.regs[2][0x02] = 0xFF;  /* Watchdog disabled */
+    picosim.regs[2][0x03] = 120;   /* FSSD timer */
+    picosim.regs[2][0x04] = 0;     /* FSSD type */
+    picosim.regs[2][0x05] = 0xFF;  /* FSSD BAT timer disabled */
+    picosim.regs[2][0x0A] = 60;    /* LPR wakeup polling timer */
+    picosim.regs[2][0x0B] = 0;     /* Relay */
+    picosim.regs[2][0x10] = 0;     /* IO pin mode */
+    picosim.regs[2][0x11] = 0;     /* IO pin value */
+    picosim.regs[2][0x12] = 0;
+  }
+}
+
+/* Returns the seconds of the system clock the simulated RTC follows. time() can lag the start of a
+   second by a scheduler tick, which --rtc-edge would see as an offset */
+static time_t simclock(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec;
+}
+
+/* Spends the configured per transaction latency, cut short by the timeout, and fails the configured
+   share of transactions. Returns -1 when the transaction fails */
+static int simdelay(void)
+{
+  struct timespec delay;
+  long latency = picosim.latency;
+
+  if (picosim.timeout >= 0 && latency > picosim.timeout * 1000L) {
+    latency = picosim.timeout * 1000L;
+  }
+  if (latency > 0) {
+    delay.tv_sec = latency / 1000000;
+    delay.tv_nsec = (latency % 1000000) * 1000;
+    while (nanosleep(&delay, &delay) < 0 && errno == EINTR) {
+    }
+  }
+  if (latency < picosim.latency) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  if (picosim.errors > 0 && rand_r(&picosim.seed) % 1000 < picosim.errors) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+/* Takes an unsigned int (16 bit) in Binary Coded Decimal (BCD) and returns a regular integer */
+int bcdword2dec(unsigned int bcd)
+{
+  int a;
+  int b;
+  int c;
+  int d;
+  a = (bcd >> 12)&0x000F;
+  b = (bcd >> 8)&0x000F;
+  c = (bcd >> 4)&0x000F;
+  d = bcd&0x000F;
+  return((a*1000)+(b*100)+(c*10)+d);
+}
+
+/* Takes an unsigned small int (8 bit) in Binary Coded Decimal (BCD) and returns a regular integer */
+int bcdbyte2dec(unsigned int bcd)
+{
+  int a;
+  int b;
+  a = (bcd >> 4)&0x000F;
+  b = bcd&0x000F;
+  return((a*10)+b);
+}
+
+/* Takes a regular integer between 0 and 99 and returns it as an 8 bit Binary Coded Decimal (BCD) */
+int dec2bcdbyte(unsigned int dec)
+{
+  return(((dec / 10) % 10) << 4 | (dec % 10));
+}
+
+/* Takes a regular integer between 0 and 9999 and returns it as a 16 bit Binary Coded Decimal (BCD) */
+int dec2bcdword(unsigned int dec)
+{
+  return((dec2bcdbyte(dec / 100) << 8) | dec2bcdbyte(dec % 100));
+}
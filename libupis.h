@@ -0,0 +1,72 @@
+/*
+  Name:     libupis.h
+  Revision: 5.0.2
+  Purpose:  Access to the UPiS PiCo interface from C, and from other languages
+            through their C bindings. Only the upis* functions below are exported
+            by libupis.so; the upis and upisd front-ends also use libupispriv.h
+  Build:    make libupis.so libupis.a, see Makefile for the i2c-tools headers needed, or
+            gcc -pthread -fPIC -shared -o libupis.so libupis.c             (shared)
+            gcc -pthread -c libupis.c && ar rcs libupis.a libupis.o        (static)
+*/
+
+#ifndef LIBUPIS_H
+#define LIBUPIS_H
+
+#include <time.h>
+
+/* Environment variable selecting the transport when upisopen is given none */
+#define UPIS_TRANSPORT_ENV "UPIS_TRANSPORT"
+
+/* UPiS RTC page: BCD registers 0x00-0x06 and the correction factor 0x07 at address 0x69 */
+#define UPIS_RTCPAGE_LEN 0x08
+/* UPiS status page: registers 0x00-0x0D at address 0x6A */
+#define UPIS_STATUS_LEN 0x0E
+/* UPiS config page: registers 0x00-0x12 at address 0x6B, 0x11 holds the IO pin value byte or word */
+#define UPIS_CONFIG_LEN 0x13
+
+/* Page bits of struct upissnapshot */
+#define UPIS_PAGE_RTC    0x01
+#define UPIS_PAGE_STATUS 0x02
+#define UPIS_PAGE_CONFIG 0x04
+#define UPIS_PAGE_ALL    0x07
+
+/* Raw register pages of all three PiCo addresses and when they were read */
+struct upissnapshot {
+  int pages;                                /* UPIS_PAGE_* bits of the pages holding data */
+  unsigned int bus;                         /* Bus and base address the pages were read from */
+  unsigned int base;
+  struct timespec monotonic;                /* CLOCK_MONOTONIC time of the read */
+  struct timespec realtime;                 /* CLOCK_REALTIME time of the read */
+  unsigned char rtc[UPIS_RTCPAGE_LEN];      /* 0x69 registers 0x00-0x07 */
+  unsigned char status[UPIS_STATUS_LEN];    /* 0x6A registers 0x00-0x0D */
+  unsigned char config[UPIS_CONFIG_LEN];    /* 0x6B registers 0x00-0x12 */
+};
+
+/* Library API. A session keeps its bus open between calls, so any number of values can be read or
+   set without reopening it. Calls return -1 on failure, with the reason given by upiserror, rather
+   than exiting. A session may be used by one thread at a time; sessions on separate buses can be
+   used concurrently. Calls on the same bus by other processes are kept apart by the bus lock */
+struct upis;
+
+/* Sets, for every session, the milliseconds to wait for another process to finish with the bus
+   and the number of times a failed transaction is attempted again, 1000 and 2 by default. Unless
+   -1, timeout in milliseconds and adapterretries are given to the I2C adapter of buses opened
+   afterwards. As the upis --lock-wait, --retries, --timeout and --adapter-retries options */
+void upislimits(long lockwait, unsigned int retries, int timeout, int adapterretries);
+/* Opens a session on the PiCo interface at base (0x69 for a standard UPiS) on an I2C bus. transport
+   is i2c-dev or sim[:LATENCY[:ERRORS]], NULL for the UPIS_TRANSPORT environment variable or i2c-dev.
+   Returns NULL on failure, when upiserror(NULL) gives the reason */
+struct upis *upisopen(unsigned int bus, unsigned int base, const char *transport);
+/* Reads the RTC, status and config pages in one transaction where the bus allows, see struct upissnapshot */
+int upisreadsnapshot(struct upis *upis, struct upissnapshot *snapshot);
+/* Reads one value, named as the upis long option, such as batvolt or fssdtimeout. Voltages are in
+   Volts, currents in mA, temperatures in degrees and timers in seconds; rtc is in seconds since the epoch */
+int upisread(struct upis *upis, const char *name, double *value);
+/* Sets one value, named as the upis long option, such as fssdtimeout or relay, and reads it back */
+int upiswrite(struct upis *upis, const char *name, int value);
+/* Describes the last failure of a session, or of upisopen when upis is NULL */
+const char *upiserror(const struct upis *upis);
+/* Closes the bus and frees the session */
+void upisclose(struct upis *upis);
+
+#endif
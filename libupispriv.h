@@ -0,0 +1,237 @@
+/*
+  Name:     libupispriv.h
+  Revision: 5.0.2
+  Purpose:  Internals of libupis shared with the upis and upisd front-ends, which are
+            built from libupis.c or link libupis.a. May change between releases. Hidden
+            from the dynamic symbol table, so libupis.so only exports libupis.h
+*/
+
+#ifndef LIBUPISPRIV_H
+#define LIBUPISPRIV_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "libupis.h"
+
+#pragma GCC visibility push(hidden)
+
+
+/* UPiS RTC page: BCD registers 0x00-0x06 at address 0x69 */
+#define UPIS_RTC_LEN 0x07
+/* Number of times the RTC page is re-read when a seconds rollover is detected */
+#define UPIS_RTC_RETRIES 3
+/* Rate change of the RTC, in parts per million, for each tick a second of its 32768Hz crystal
+   added or deducted by the correction factor, 0x69/0x07 */
+#define UPIS_RTC_TICK_PPM (1e6 / 32768)
+
+/* Decoded snapshot of the status page, all values taken from a single block read */
+struct upisstatus {
+  int pwrsrc;     /* 0x00 Power source, 1=EPR ... 7=BPR */
+  int batvolt;    /* 0x01 BAT voltage in 1/100 Volts */
+  int rpivolt;    /* 0x03 RPI voltage in 1/100 Volts */
+  int usbvolt;    /* 0x05 USB voltage in 1/100 Volts */
+  int eprvolt;    /* 0x07 EPR voltage in 1/100 Volts */
+  int current;    /* 0x09 Average current in mA */
+  int centigrade; /* 0x0B Temperature in Centigrade */
+  int fahrenheit; /* 0x0C Temperature in Fahrenheit */
+};
+
+/* A PiCo interface: the bus it is on and the address of its RTC page, the status and config
+   pages follow at base + 1 and base + 2. Registers are always named by the addresses of the
+   default device, 0x69-0x6B, and moved to the device in use when the bus is accessed */
+#define UPIS_DEVICES 16
+struct upisdevice {
+  unsigned int bus;
+  unsigned int base;
+};
+
+/* Registers tracked per PiCo address by a struct upisplan, covers every page */
+#define UPIS_PLAN_REGS 0x20
+/* Most writes a single plan can queue */
+#define UPIS_PLAN_WRITES 16
+/* Unneeded registers a planned read may span to merge two ranges into one message */
+#define UPIS_PLAN_GAP 4
+/* Index of a PiCo address (0x69-0x6B) in a struct upisplan */
+#define UPIS_PLAN_PAGE(addr) ((addr) - 0x69)
+
+/* A register write queued in a plan */
+struct upisplanwrite {
+  unsigned int addr;
+  unsigned int reg;
+  unsigned int val;
+  int verify;       /* Read the register back once all writes are done */
+};
+
+/* Every register access of one invocation. Registers are read once, in one batch, before
+   any write; written registers, and reads spanning them, are read once, in a second batch,
+   after all writes */
+struct upisplan {
+  unsigned char need[3][UPIS_PLAN_REGS];    /* Registers to read before the writes */
+  unsigned char verify[3][UPIS_PLAN_REGS];  /* Registers to read back after the writes */
+  unsigned char value[3][UPIS_PLAN_REGS];   /* Register values, read back values replace earlier ones */
+  unsigned int writes;
+  struct upisplanwrite write[UPIS_PLAN_WRITES];
+};
+
+/* One decoded value of a snapshot, see snapshotfields */
+#define UPIS_FIELDS 24
+struct upisfield {
+  const char *name;   /* Named after the long option displaying the value */
+  char value[32];
+  int isstring;       /* Quoted in JSON */
+};
+
+/* Kinds of register described by struct upisregister, deciding how values are decoded, displayed and set */
+#define UPIS_KIND_RTC     1   /* The BCD date and time registers, the argument picks the display format */
+#define UPIS_KIND_BYTE    2   /* Binary byte, set within min-max when the option takes an argument */
+#define UPIS_KIND_WORD    3   /* Binary word, low byte first */
+#define UPIS_KIND_BCD     4   /* BCD byte */
+#define UPIS_KIND_BCDWORD 5   /* BCD word, low byte first */
+#define UPIS_KIND_PWRSRC  6   /* Power source number, named with -v */
+#define UPIS_KIND_RELAY   7   /* Relay state, set by name */
+#define UPIS_KIND_IOVALUE 8   /* IO mode byte followed by the IO value, a word in mode 1 and a byte otherwise */
+#define UPIS_KIND_ACTION  9   /* Writes min to the register, after confirmation when confirm is set */
+#define UPIS_KIND_TODO   10   /* Not implemented yet */
+
+/* Descriptor of one PiCo value and of the upis option displaying or setting it, see upisregisters */
+struct upisregister {
+  const char *name;       /* Long option, also the field name of --all and socket queries */
+  int key;                /* Short option */
+  const char *arg;        /* Name of the optional argument, 0 for none */
+  unsigned int addr;      /* PiCo address, 0 when not implemented */
+  unsigned int reg;       /* First register */
+  unsigned int len;       /* Registers read to display the value */
+  int kind;               /* UPIS_KIND_... */
+  int min;                /* Valid values when setting; actions write min */
+  int max;
+  int scale;              /* Displayed values are the decoded value divided by scale */
+  const char *unit;       /* Suffix displayed with -v */
+  const char *label;      /* Prefix when several values are displayed, also used when set */
+  const char *what;       /* Named in error and abort messages */
+  const char *confirm;    /* Warning displayed before an action, 0 for none */
+  const char *done;       /* Displayed once an action is done */
+  const char *doc;        /* Option help */
+};
+
+/* Snapshot published by upisd for other processes, see shmpublish and shmread */
+#define UPIS_SHM_PATH "/dev/shm/upis"
+#define UPIS_SHM_MAGIC 0x53495055 /* "UPIS" */
+struct upisshm {
+  unsigned int magic;               /* UPIS_SHM_MAGIC once the first snapshot is published */
+  unsigned int seq;                 /* Seqlock sequence, odd while the snapshot is being written */
+  struct upissnapshot snapshot;
+};
+
+/* History ring written by upisd: a header followed by a fixed number of fixed width records,
+   oldest overwritten first. See ringcreate, ringappend, ringflush and ringquery */
+#define UPIS_RING_PATH "/var/lib/upis/history"
+#define UPIS_RING_MAGIC 0x52495055 /* "UPIR" */
+#define UPIS_RING_RECORDS 40320    /* Four weeks at one record a minute */
+#define UPIS_RING_PENDING 64       /* Records held in memory between flushes */
+#define UPIS_RING_VALUES 7         /* batvolt, rpivolt, usbvolt, eprvolt, current, centigrade, fahrenheit */
+struct upisringhead {
+  uint32_t magic;                   /* UPIS_RING_MAGIC once initialised */
+  uint32_t size;                    /* sizeof(struct upisrecord), guards against layout changes */
+  uint32_t records;                 /* Number of record slots */
+  uint32_t reserved;
+  uint64_t next;                    /* Records ever appended, the next slot is next % records */
+};
+struct upisrecord {
+  int64_t time;                     /* Milliseconds since the epoch */
+  int16_t value[UPIS_RING_VALUES];  /* Decoded status page, voltages in 1/100 Volts */
+  uint8_t pwrsrc;
+  uint8_t reserved;
+};
+struct upisring {
+  struct upisringhead *head;        /* Mapped file */
+  struct upisrecord *record;        /* Record slots following the header */
+  size_t length;                    /* Length of the mapping */
+  unsigned int pending;
+  struct upisrecord buffer[UPIS_RING_PENDING];
+};
+/* Summary of the records in a time range, see ringquery */
+struct upishistory {
+  unsigned long long count;
+  int64_t first;                    /* Time of the first and last record, in milliseconds */
+  int64_t last;
+  long long min[UPIS_RING_VALUES];
+  long long max[UPIS_RING_VALUES];
+  long long sum[UPIS_RING_VALUES];
+  unsigned long long pwrsrc[8];     /* Records per power source, 0 for unknown */
+};
+
+/* Work of one device for the --bus and --base-address lists, see runjobs */
+struct upisjob {
+  struct upisdevice device;
+  int all;                        /* Read every page into snapshot rather than carry out plan */
+  struct upisplan plan;
+  struct upissnapshot snapshot;
+};
+
+/* Every value upis can display or set, see libupis.c */
+#define UPIS_REGISTERS 29
+extern const struct upisregister upisregisters[];
+
+/* Settings of every session, see libupis.c. Set them before opening a bus */
+extern long i2clockwait;
+extern unsigned int i2cretries;
+extern int i2ctimeout;
+extern int i2cadapterretries;
+/* Snapshot and device of the calling thread, see readcache and struct upisdevice */
+extern __thread struct upissnapshot *i2ccache;
+extern __thread struct upisdevice i2cdevice;
+
+/* Prototypes */
+int upisrunplan(struct upis *upis, struct upisplan *plan);
+int i2cselect(const char *name);
+void statsstart(void);
+void statssection(const char *name);
+void statsreport(void);
+void latencyreport(void);
+long long elapsedns(const struct timespec *begin, const struct timespec *end);
+void i2cclose(void);
+void i2clock(unsigned int i2cbus);
+void i2cunlock(void);
+void readi2cblock(unsigned int i2cbus, unsigned int i2caddr, unsigned int i2creg, unsigned int i2clen, unsigned char *i2cbuf);
+void readstatus(struct upisstatus *status);
+void decodestatus(const unsigned char *page, struct upisstatus *status);
+void readrtc(struct tm *rtc);
+void readrtcpage(unsigned char *page, unsigned int len);
+void decodertc(const unsigned char *page, struct tm *rtc);
+time_t rtcedge(struct timespec *monotonic, struct timespec *realtime, long long *uncertainty);
+void writertc(const struct tm *rtc);
+void readsnapshot(struct upissnapshot *snapshot);
+void readpages(struct upissnapshot *snapshot, int pages);
+int snapshotfields(const struct upissnapshot *snapshot, struct upisfield *fields);
+const char *pwrsrcname(int pwrsrc);
+const struct upisregister *registerfind(const char *name);
+const unsigned char *registerpage(const struct upissnapshot *snapshot, unsigned int i2caddr);
+int registervalue(const struct upisregister *reg, const unsigned char *page);
+int registersets(const struct upisregister *reg);
+void planinit(struct upisplan *plan);
+void planread(struct upisplan *plan, unsigned int i2caddr, unsigned int i2creg, unsigned int i2clen);
+void planwrite(struct upisplan *plan, unsigned int i2caddr, unsigned int i2creg, unsigned int i2cval, int verify);
+void runplan(struct upisplan *plan);
+void readplan(unsigned char marks[3][UPIS_PLAN_REGS], unsigned char value[3][UPIS_PLAN_REGS]);
+int planbyte(const struct upisplan *plan, unsigned int i2caddr, unsigned int i2creg);
+int planword(const struct upisplan *plan, unsigned int i2caddr, unsigned int i2creg);
+struct upisshm *shmcreate(const char *path);
+void shmpublish(struct upisshm *shm, const struct upissnapshot *snapshot);
+int shmread(const char *path, long maxage, struct upissnapshot *snapshot);
+void ringcreate(struct upisring *ring, const char *path, unsigned int records);
+void ringappend(struct upisring *ring, const struct upissnapshot *snapshot);
+void ringflush(struct upisring *ring);
+int ringquery(const char *path, int64_t from, int64_t to, struct upishistory *history);
+void runjobs(struct upisjob *jobs, unsigned int count);
+int readi2cbyte(unsigned int i2cbus, unsigned int i2caddr, unsigned int i2creg);
+int readi2cword(unsigned int i2cbus, unsigned int i2caddr, unsigned int i2creg);
+void writei2cbyte(unsigned int i2cbus, unsigned int i2caddr, unsigned int i2creg, unsigned int i2cval);
+int bcdbyte2dec(unsigned int bcd);
+int bcdword2dec(unsigned int bcd);
+int dec2bcdbyte(unsigned int dec);
+int dec2bcdword(unsigned int dec);
+
+#pragma GCC visibility pop
+
+#endif
@@ -5,847 +5,2461 @@
   Date:     02-Nov-14
   Purpose:  Reports UPiS PICo interface values in Raspberry Pi command line
             and controls UPiS from Raspberry Pi command line
+  Build:    make, see Makefile for the i2c-tools headers needed, or
+            gcc -pthread -o upis upis.c libupis.c -lm
+            gcc -pthread -DUPISD -o upisd upis.c libupis.c -lm   (polling daemon)
+            or link against libupis.a; libupis.so only exports the API of libupis.h
+  Bench:    sudo make bench, against the i2c-stub driver, see bench.sh
 */
 
-#include <linux/i2c-dev.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
 #include <argp.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <grp.h>
+#include <syslog.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <pthread.h>
+#include <math.h>
+#include "libupispriv.h"
+
+/* Battery voltage, in 1/100 Volts, the battery must rise above the --batlow threshold by
+   before another batlow event is reported */
+#define UPIS_BATLOW_HYSTERESIS 5
+
+/* Milliseconds --keepalive waits before setting the watchdog timer again after a failed attempt */
+#define UPIS_KEEPALIVE_RETRY 250
+/* Attempts --keepalive makes to disable the watchdog timer when interrupted, after the first */
+#define UPIS_KEEPALIVE_STOPS 4
+
+/* Samples --sample buffers between the bus and the statistics threads, a power of 2 */
+#define UPIS_SAMPLE_RING 4096
+/* Values --sample takes from the status page, each a BCD word from 0 to 9999 */
+#define UPIS_SAMPLE_VALUES 5
+#define UPIS_SAMPLE_MAX 10000
+
+/* A status page read by --sample, indexed by register number, see registervalue */
+struct upissample {
+  struct timespec time;           /* CLOCK_MONOTONIC once read */
+  unsigned char page[0x0B];       /* Registers 0x01-0x0A: BAT, RPI, USB and EPR voltages and the current */
+};
+/* Single producer, single consumer ring from the bus thread to the statistics thread. Each index is
+   only written by its own thread and published with release ordering, so neither ever waits */
+struct samplering {
+  uint64_t head __attribute__((aligned(64)));   /* Samples written, by the bus thread */
+  uint64_t tail __attribute__((aligned(64)));   /* Samples taken, by the statistics thread */
+  uint64_t dropped __attribute__((aligned(64))); /* Samples lost to a full ring */
+  int done;                                      /* Set by the bus thread once it stops */
+  double window;                                 /* Seconds of samples in each summary */
+  struct upissample sample[UPIS_SAMPLE_RING];
+};
 
 /* Prototypes */
 void strlower(char *string);
-int readi2cbyte(unsigned int i2cbus, unsigned int i2caddr, unsigned int i2creg);
-int readi2cword(unsigned int i2cbus, unsigned int i2caddr, unsigned int i2creg);
-void writei2cbyte(unsigned int i2cbus, unsigned int i2caddr, unsigned int i2creg, unsigned int i2cval);
-int bcdbyte2dec(unsigned int bcd);
-int bcdword2dec(unsigned int bcd);
+int is_intstr(char *intstr);
+void printsnapshot(const struct upissnapshot *snapshot);
+int printrecord(const struct upissnapshot *snapshot, const char *format, const char **names, int stream);
+void watchpages(int pages, const char **names, const char *format, double interval, const char *shmpath, long maxage);
+int watchtimer(double interval);
+void watchevents(long interval, int batlow, const char *hook, int notifyfd);
+void sendevent(const char *event, const char *from, const char *to, int batvolt, const char *hook, int notifyfd);
+void watchkeepalive(int timeout, double fraction, const char *health, int priority, const char *transport);
+int keepalivewrite(struct upis *upis, int value);
+int healthcheck(const char *health, int timeout);
+void watchsamples(double window);
+void *samplestats(void *data);
+void printedge(time_t rtc, const struct timespec *realtime, long long uncertainty, const char *extra);
+void rtcsync(const char *to);
+void rtccalibrate(long duration, long interval, int apply);
+int rtcfactor(double drift, int current, double *residual);
+long parseduration(const char *string);
+int registerparse(const struct upisregister *reg, char *arg, int *value);
+void registerprint(const struct upisregister *reg, const unsigned char *page, char *arg, int verbose, int labelled);
+void printhistory(const struct upishistory *history);
+int parsehistorytime(const char *string, int64_t *ms);
+unsigned int parselist(char *list, unsigned int *values, unsigned int min, unsigned int max);
+int runbatch(const char *path, const char *transport, int yes, int verbose);
+int readprofile(const char *path, int *values);
+void applyprofile(const int *values);
+void dumpprofile(void);
 
 /* ARGP Setup */
+#ifdef UPISD
+const char *argp_program_version = "upisd 5.0.2";
+#else
 const char *argp_program_version = "upis 5.0.2";
+#endif
 const char *argp_program_bug_address = "<graham@the-singles.co.uk>";
+#ifndef UPISD
+/* Keys for long options without a short option */
+#define OPT_MAXAGE 256
+#define OPT_SHM    257
+#define OPT_TRANSPORT 258
+#define OPT_STATS  259
+#define OPT_ALL    260
+#define OPT_FORMAT 261
+#define OPT_WATCH  262
+#define OPT_HISTORY 263
+#define OPT_RING   264
+#define OPT_EVENTS 265
+#define OPT_BATLOW 266
+#define OPT_HOOK   267
+#define OPT_NOTIFYFD 268
+#define OPT_BUS    269
+#define OPT_BASE   270
+#define OPT_LOCKWAIT 271
+#define OPT_TIMEOUT 272
+#define OPT_RETRIES 273
+#define OPT_ADAPTERRETRIES 274
+#define OPT_LATENCY 275
+#define OPT_BATCH  276
+#define OPT_APPLY  277
+#define OPT_DUMPPROFILE 278
+#define OPT_KEEPALIVE 279
+#define OPT_HEALTH 280
+#define OPT_PRIORITY 281
+#define OPT_SAMPLE 282
+#define OPT_RTCEDGE 283
+#define OPT_RTCSYNC 284
+#define OPT_RTCCALIBRATE 285
 /* ARGP Argument and Parameters */  
 struct arguments {
-  int rtc;      /* The -R   & --rtc flag */
-  int rtcfactor;   /* The -F   & --rtcfactor */ 
-  int pwrsrc;        /* The -s   & --pwrsrc flag */
-  int batvolt;      /* The -b   & --batvolt flag */
-  int rpivolt;      /* The -p   & --rpivolt flag */
-  int eprvolt;      /* The -e   & --eprvolt flag */
-  int usbvolt;      /* The -u   & --usbvolt flag */
-  int current;      /* The -a   & --current flag */
-  int centigrade;   /* The -c   & --centigrade flag */
-  int fahrenheit;   /* The -f   & --fahrenheit flag */
-  int fwver;      /* The -Q   & --fwver flag */
-  int factory;      /* The -Z   & --factory flag */     
-  int reset;      /* The -z   & --reset flag */
-  int bootloader;   /* The -l   & --bootloader flag */
-  int errorno;      /* The -E    & --errorno flag */
-  int watchdog;      /* The -w    & --watchdog flag */
-  int fssd;         /* The -S    & --fssd flag */
-  int fssdtimeout;   /* The -t    & --fssdtimeout flag */
-  int fssdtype;      /* The -T   & --fssdtype flag */
-  int fssdbatime;   /* The -B    & --fssdbatime flag */
-  int starttimer;   /* The -o    & --starttimer flag */
-  int stoptimer;   /* The -O   & --stoptimer flag */
-  int lprtimer;      /* The -L   & --lprtimer flag */
-  int relay;      /* The -r    & --relay flag */
-  int eprlowv;      /* The -h   & --eprlowv flag */ 
-  int minlprtime;   /* The -m   & --minlprtime flag */
-  int lprcurrent;   /* The -I   & --lprcurrent flag */
-  int iomode;      /* The -i   & --iomode flag */
-  int iovalue;      /* The -V   & --iovalue flag */
+  int flag[UPIS_REGISTERS];   /* Register options given, indexed as upisregisters */
+  char *arg[UPIS_REGISTERS];  /* Their arguments */
   int yes;         /* The -y   & --yes flag */
   int verbose;      /* The -v   & --verbose flag */
-  char *RTCF;      /* Argument for -F */
-  char *WDTIM;      /* Argument for -w */
-  char *FSSDTIM;   /* Argument for -t */
-  char *FSSDACT;   /* Argument for -T */
-  char *BATTIM;      /* Argument for -B */
-  char *ONTIM;      /* Argument for -o */
-  char *OFFTIM;      /* Argument for -O */
-  char *LPRTIM;      /* Argument for -L */
-  char *RLYSTAT;   /* Argument for -r */     
-  char *EPRLOWV;   /* Argument for -h */
-  char *MINLPRTIM;   /* Argument for -m */
-  char *LPRAMP;      /* Argument for -I */        
-  char *IOMODE;      /* Argument for -i */
+  char *MAXAGE;     /* Argument for --max-age */
+  char *SHM;        /* Argument for --shm */
+  char *TRANSPORT;  /* Argument for --transport */
+  int stats;        /* The --stats flag */
+  int all;          /* The --all flag */
+  char *FORMAT;     /* Argument for --format */
+  char *WATCH;      /* Argument for --watch */
+  int history;      /* The --history flag */
+  char *RANGE;      /* Argument for --history */
+  char *RING;       /* Argument for --ring */
+  int events;       /* The --events flag */
+  char *EVENTINT;   /* Argument for --events */
+  char *BATLOW;     /* Argument for --batlow */
+  char *HOOK;       /* Argument for --hook */
+  char *NOTIFYFD;   /* Argument for --notify-fd */
+  char *BUS;        /* Argument for --bus */
+  char *BASE;       /* Argument for --base-address */
+  char *LOCKWAIT;   /* Argument for --lock-wait */
+  char *TIMEOUT;    /* Argument for --timeout */
+  char *RETRIES;    /* Argument for --retries */
+  char *ADAPTERRETRIES; /* Argument for --adapter-retries */
+  int latency;      /* The --latency flag */
+  char *BATCH;      /* Argument for --batch */
+  char *PROFILE;    /* Argument for --apply */
+  int dumpprofile;  /* The --dump-profile flag */
+  char *KEEPALIVE;  /* Argument for --keepalive */
+  char *HEALTH;     /* Argument for --health */
+  char *PRIORITY;   /* Argument for --priority */
+  char *SAMPLE;     /* Argument for --sample */
+  int rtcedge;      /* The --rtc-edge flag */
+  char *RTCSYNC;    /* Argument for --rtc-sync */
+  char *CALIBRATE;  /* Argument for --rtc-calibrate */
 };
-/* OPTIONS.  Field 1 in ARGP. Order of fields: {NAME, KEY, ARG, FLAGS, DOC}. */
-static struct argp_option options[] =
+/* Options other than the register options, which are generated from upisregisters by setoptions */
+static const struct argp_option cmdoptions[] =
 {
-  {"rtc",'R',0,0,"Display time from the UPiS RTC in DD-MM-YYY HH:MM:SS (DOW) format"},
-  {"rtcfactor",'F',"RTCF",OPTION_ARG_OPTIONAL,"Display, or set, the Real Time Clock correction factor. Valid values are between 0 and 255. Changes the RTC timer in multiples of 1 tick per second where a timer tick is 1/32768 HZ or 0.000030517578125 Seconds. Use 0 or 128 to let the clock run at its normal rate. Values between 1 and 127 will deduct the number of ticks specified per second and make the clock run progressively slower. Values between 129 and 255 will make the clock run progressive faster, where the number of ticks added will the specified value minus 128. In a 24 hour period adding or subtractng one tick changes the RTC by 86400 * 0.000030517578125 = 2.63671875 Seconds"},
-  {"pwrsrc",'s',0,0,"Display the current UPiS power source:\n1=EPR,2=USB,3=RPI,4=BAT,5=LPR,6=CPR and 7=BPR\nWhen combined with -v displays power source name rather than number"},
-  {"batvolt",'b',0,0,"Display the current UPiS battery voltage in Volts"},
-  {"rpivolt",'p',0,0,"Display the voltage from the Raspberry Pi over the GPIO header in Volts"},
-  {"eprvolt",'e',0,0,"Display the voltage at the UPiS EPR connector in Volts"},
-  {"usbvolt",'u',0,0,"Display the voltage at the UPiS USB connector in Volts"},
-  {"current",'a',0,0,"Display the mean current supplying both the UPiS and Raspberry Pi in mA"},
-  {"centigrade",'c',0,0,"Display the UPiS temperature in Centigrade"},
-  {"fahrenheit",'f',0,0,"Display the UPiS temperature in Fahrenheit"},
-  {"fwver",'Q',0,0,"Display the UPiS firmware version number"},
-  {"factory",'Z',0,0,"Perform a factory reset of the UPiS. Requires confirmation if not used with -y argument"},
-  {"reset",'z',0,0,"Reset the UPiS CPU, apply startup values and reset RTC to 01/01/2012"},
-  {"bootloader",'l',0,0,"Place the UPiS in bootloader mode (Red LED will flash). Requires confirmation if not used with -y argument"},
-  {"errorno",'E',0,0,"Display the last UPiS error code, where 0 equals no error"},
-  {"watchdog",'w',"WDTIM",OPTION_ARG_OPTIONAL,"Display or set the UPiS watchdog countdown timer in seconds. Setting the timer to 255 will disable it. When the timer reaches 0 seconds file safe shutdown will be triggered"},
-  {"fssd",'S',0,0,"Trigger a file safe shutdown"}, 
-  {"fssdtimeout",'t',"FSSDTIM",OPTION_ARG_OPTIONAL,"Display or set the file safe shutdown power off timer. This is the amount of time the UPiS will wait after initiating file safe shutdown, before power is removed from the Raspberry Pi"},
-  {"fssdtype",'T',"FSSDACT",OPTION_ARG_OPTIONAL,"Display, or set, the UPiS action to be taken upon File Safe Shutdown, 0 will cut power and 1 will leave the Raspberry Pi powered on"},
-  {"fssdbatime",'B',"BATTIM",OPTION_ARG_OPTIONAL,"Display, or set, a timer in seconds that will unconditionally cause file safe shutdown in battery mode when it reaches 0. Set to 255 to disable the timer"}, 
-  {"starttimer",'o',"ONTIM",OPTION_ARG_OPTIONAL,"Display, or set, a timer that will cause the UPiS to wake up from LPR mode after it has been asleep for the sepcified number of seconds"},
-  {"stoptimer",'O',"OFFTIM",OPTION_ARG_OPTIONAL,"Display, or set, a timer that will cause the UPiS to initiate file safe shutdown after it has been awake (out of LPR mode) for the specified number of seconds"},
-  {"lprtimer",'L',"LPRTIM",OPTION_ARG_OPTIONAL,"Display, or set, the interval at which the UPiS will check for the presence of power and wakeup while in LPR mode"}, 
-  {"relay",'r',"RLYSTAT",OPTION_ARG_OPTIONAL,"Display, or set, the relay state. Permissable value are: 1, 0, on, off, open or closed"},
-  {"eprlowv",'h',"EPRLOWV",OPTION_ARG_OPTIONAL,"Display, or set, the EPR supply voltage below which the UPiS will switch to battery mode"},
-  {"minlprtime",'m',"MINLPRTIM",OPTION_ARG_OPTIONAL,"Display, or set, the minimum interval that the UPiS will run in battery mode before resuming EPR power. This can be used to prevent the UPiS toggling between BAT and EPR power unecessarly when the ERP supply is unstable, such as solar power"},
-  {"lprcurrent",'I',"LPRAMP",OPTION_ARG_OPTIONAL,"Display, or set, the current in miliamps drawn by the Raspberry Pi below which the UPiS to switch to LPR mode. Tune this value so that the UPiS correctly switches to LPR mode once the Raspberry Pi is shutdown. The exact current depands on what boards are attached to the Raspberry Pi and USB peripherals"},
-  {"iomode",'i',"IOMODE",OPTION_ARG_OPTIONAL,"Display, or set, the mode of the 1 wire io pin of the UPiS.\n0=none\n1=1 wire temp value\n2=8 bit A to D convertor value\n3= Status of forced On-Change (Advanced Only)"}, 
-  {"iovalue",'V',0,0,"Display the value read from the 1 wire IO pin based on the mode set by -i"},
   {"yes",'y',0,0,"Perform the reset -z, factory default -Z or bootloader -l options without prompting for confirmation"},
   {"verbose",'v',0,0,"Be verbose. Values will be suffixed by units and power modes are described by their name rather than mode number"},
+  {"max-age",OPT_MAXAGE,"MAXAGE",0,"Display values from the snapshot published by upisd when it is no older than MAXAGE milliseconds, rather than reading the PiCo interface. Falls back to the PiCo interface when upisd is not running or the snapshot is too old"},
+  {"shm",OPT_SHM,"SHM",0,"Path of the snapshot published by upisd. Default is " UPIS_SHM_PATH},
+  {"all",OPT_ALL,0,0,"Display every value of the UPiS as one record, read in a single transaction where the bus allows. Voltages are in Volts, currents in mA, temperatures in Centigrade and Fahrenheit and timers in seconds. Other display options are ignored"},
+  {"format",OPT_FORMAT,"FORMAT",0,"Record format for --all: kv for name=value lines, json for a JSON object or csv for a header line followed by a value line. Default is kv"},
+  {"watch",OPT_WATCH,"INTERVAL",0,"Keep the bus open and display the selected values, or every value with --all, every INTERVAL seconds until interrupted. Fractions of a second are allowed. Each sample is one timestamped line in the --format given"},
+  {"history",OPT_HISTORY,"RANGE",OPTION_ARG_OPTIONAL,"Display the number of records and the minimum, maximum and mean of each status value recorded by upisd, and how many records were taken in each power source. RANGE is FROM[,TO], each an epoch time in seconds, a local YYYY-MM-DDTHH:MM:SS time or a time relative to now such as -30m, -12h or -7d. Default is the whole history"},
+  {"ring",OPT_RING,"RING",0,"Path of the history recorded by upisd. Default is " UPIS_RING_PATH},
+  {"events",OPT_EVENTS,"EVENTINT",OPTION_ARG_OPTIONAL,"Poll the power source every EVENTINT milliseconds, 20 by default, until interrupted and report each change of power source, and the battery falling below --batlow, as soon as it is seen. Each event is one line such as time=1415000000.000 event=pwrsrc from=EPR to=BAT batvolt=4.12, written to --notify-fd, and starts the --hook command"},
+  {"batlow",OPT_BATLOW,"BATLOW",0,"With --events, also report a batlow event when the battery voltage falls below BATLOW Volts. It is reported again once the battery has recovered by 0.05 Volts and falls again"},
+  {"hook",OPT_HOOK,"HOOK",0,"With --events, run the shell command HOOK for every event without waiting for it to finish. The event is passed in the UPIS_EVENT, UPIS_FROM, UPIS_TO and UPIS_BATVOLT environment variables"},
+  {"notify-fd",OPT_NOTIFYFD,"NOTIFYFD",0,"With --events, write event lines to the open file descriptor NOTIFYFD rather than to standard output, for example a pipe to a supervising process"},
+  {"keepalive",OPT_KEEPALIVE,"WDTIM[,FRACTION]",0,"Keep the bus open and set the watchdog timer to WDTIM seconds, from 1 to 254, every FRACTION of WDTIM, 0.5 by default, until interrupted, so the UPiS only starts a file safe shutdown when upis or the --health check stops. Timer wakeups may be delayed by up to a quarter of the time left, to coincide with other timers, without ever exceeding it. The watchdog is disabled on SIGINT or SIGTERM"},
+  {"health",OPT_HEALTH,"CHECK",0,"With --keepalive, only set the watchdog timer while CHECK passes. CHECK is pid:PID, for a process that must be running, pid:PIDFILE for the process whose id is in PIDFILE, or file:PATH for a file that must have been modified within the last WDTIM seconds"},
+  {"priority",OPT_PRIORITY,"PRIO",0,"With --keepalive, run at the real time priority PRIO, from 1 to 99, of the SCHED_FIFO policy, with the memory of upis locked, so setting the watchdog is not delayed by load. Needs CAP_SYS_NICE and CAP_IPC_LOCK"},
+  {"sample",OPT_SAMPLE,"WINDOW",0,"Read the current and the BAT, RPI, EPR and USB voltages as fast as the bus allows until interrupted, and every WINDOW seconds display the number of samples, the rate, the samples lost and the minimum, maximum, mean, standard deviation and 50th, 90th and 99th percentiles of each value, one line each. The statistics are taken by a second thread, so displaying them never holds up the bus. Voltages are in Volts and the current in mA"},
+  {"rtc-edge",OPT_RTCEDGE,0,0,"Time the next change of the RTC seconds against the system clock, to within a millisecond or so, and display it as time=SYSTEMTIME rtc=RTCTIME offset=SECONDS uncertainty=SECONDS, where offset is how far the system clock is ahead of the RTC"},
+  {"rtc-sync",OPT_RTCSYNC,"TO",0,"Set the clock TO, system or rtc, from the other. The system clock is set from the time of a change of the RTC seconds, and the RTC is set as the system clock starts a second, then timed as with --rtc-edge to display the offset left. Setting the system clock needs CAP_SYS_TIME"},
+  {"rtc-calibrate",OPT_RTCCALIBRATE,"DURATION[,INTERVAL]",0,"Time the RTC as with --rtc-edge every INTERVAL seconds, 60 by default, for DURATION seconds, or minutes, hours or days with an m, h or d suffix, such as 6h, or until interrupted. Each timing is displayed with the drift of the RTC so far in parts per million (ppm), then the correction factor that best cancels the drift is recommended, and set with -y. The longer the DURATION, the more precise the drift"},
+  {"bus",OPT_BUS,"BUS",0,"Access the PiCo interfaces on each I2C bus of the comma separated list BUS, such as 1,3. Buses are accessed concurrently, one thread each, and the values of each interface are displayed in turn, in list order, after a Bus N address 0xNN: line, or as one record each with --all. --watch, --events, --keepalive, --sample, the --rtc options, --batch, --apply and --dump-profile use the first interface only. Default is 1"},
+  {"base-address",OPT_BASE,"BASE",0,"Address of the RTC page of the PiCo interfaces on each bus, or a comma separated list of them, such as 0x69,0x59. The status and config pages follow at BASE+1 and BASE+2. Default is 0x69"},
+  {"lock-wait",OPT_LOCKWAIT,"LOCKWAIT",0,"Wait up to LOCKWAIT milliseconds for other upis and upisd processes to finish with the bus before giving up. Each read of the values, and each set of writes with their read back, runs as one uninterrupted unit under a lock file in /run/lock. Default is 1000"},
+  {"timeout",OPT_TIMEOUT,"TIMEOUT",0,"Have the I2C adapter give up on a transaction after TIMEOUT milliseconds, in steps of 10. This is a setting of the adapter, so it stays in force for other programs. Default is to leave the adapter as it is"},
+  {"retries",OPT_RETRIES,"RETRIES",0,"Attempt a failed transaction up to RETRIES more times, after a pause of around 1ms doubling with each attempt up to 64ms, before giving up. The commands of --factory, --reset, --bootloader and --fssd are sent only once, as a failed one may still have been carried out. With --timeout, a transaction takes at most (RETRIES+1) times TIMEOUT plus the pauses. Default is 2"},
+  {"adapter-retries",OPT_ADAPTERRETRIES,"ADAPTERRETRIES",0,"Have the I2C adapter itself retry a transaction up to ADAPTERRETRIES times when it loses arbitration. Like --timeout, this stays in force for other programs. Default is to leave the adapter as it is"},
+  {"latency",OPT_LATENCY,0,0,"Report on stderr the median (p50), 99th percentile (p99) and slowest latency of the transactions at each register"},
+  {"batch",OPT_BATCH,"FILE",0,"Carry out the commands in FILE, or standard input when FILE is -, over one session on the bus. Each line holds the value options of one upis command, such as --fssdtimeout=60 -v, or the long options without their dashes, such as fssdtimeout=60 relay=on; -y is needed for the options that prompt for confirmation. Blank lines and lines starting with # are skipped. Consecutive lines that only display values are read together in one transaction. The values are displayed as upis would, and the status of each line is reported on stderr as FILE:LINE: ok or the reason it failed. Exits with 1 when a line was invalid and 2 when the bus failed"},
+  {"apply",OPT_APPLY,"PROFILE",0,"Bring the settings of the UPiS in line with PROFILE, or standard input when PROFILE is -. PROFILE holds name=value lines for any of rtcfactor, watchdog, fssdtimeout, fssdtype, fssdbatime, lprtimer, relay and iomode, in the format of --dump-profile; blank lines and lines starting with # are skipped. The current settings are read in one transaction and only those that differ are written, then read back together, except relay, which is written but not read back. Values that are commands rather than settings, 221, 238 and 255 for rtcfactor and 0 for watchdog, are refused. Each setting changed is displayed as name=value (was old)"},
+  {"dump-profile",OPT_DUMPPROFILE,0,0,"Display every setting of the UPiS as name=value lines, read in one transaction, for --apply"},
+  {"stats",OPT_STATS,0,0,"Report on stderr the number of bus opens, slave address switches, transactions and bytes moved, and the time spent fetching, writing and displaying each option"},
+  {"transport",OPT_TRANSPORT,"TRANSPORT",0,"Access the PiCo interface through TRANSPORT: i2c-dev for the real /dev/i2c-N bus, or sim[:LATENCY[:ERRORS]] for a built in simulator of the PiCo registers taking LATENCY microseconds per transaction and failing ERRORS transactions in a thousand. Defaults to the " UPIS_TRANSPORT_ENV " environment variable, or i2c-dev"},
   {0}
 };
+/* OPTIONS.  Field 1 in ARGP. Order of fields: {NAME, KEY, ARG, FLAGS, DOC}. */
+static struct argp_option options[UPIS_REGISTERS + sizeof(cmdoptions) / sizeof(cmdoptions[0])];
+/* Fills options with an option per register followed by cmdoptions */
+static void setoptions(void)
+{
+  unsigned int index;
+
+  for (index = 0; index < UPIS_REGISTERS; index++) {
+    options[index].name = upisregisters[index].name;
+    options[index].key = upisregisters[index].key;
+    options[index].arg = upisregisters[index].arg;
+    options[index].flags = upisregisters[index].arg ? OPTION_ARG_OPTIONAL : 0;
+    options[index].doc = upisregisters[index].doc;
+  }
+  memcpy(&options[UPIS_REGISTERS], cmdoptions, sizeof(cmdoptions));
+}
 /* PARSER. Field 2 in ARGP. Order of parameters: KEY, ARG, STATE. */
 static error_t
 parse_opt (int key, char *arg, struct argp_state *state)
 {
   struct arguments *arguments = state->input;
+  unsigned int index;
+
+  for (index = 0; index < UPIS_REGISTERS; index++) {
+    if (key == upisregisters[index].key) {
+      arguments->flag[index]=1;
+      arguments->arg[index]=arg;
+      return 0;
+    }
+  }
   switch (key) {
-    case 'R': arguments->rtc=1; break;
-    case 'F': arguments->rtcfactor=1; arguments->RTCF=arg; break;
-    case 's': arguments->pwrsrc=1; break;
-    case 'b': arguments->batvolt=1; break;
-    case 'p': arguments->rpivolt=1; break;
-    case 'e': arguments->eprvolt=1; break;
-    case 'u': arguments->usbvolt=1; break;
-    case 'a': arguments->current=1; break;
-    case 'c': arguments->centigrade=1; break;
-    case 'f': arguments->fahrenheit=1; break;
-    case 'Q': arguments->fwver=1; break;
-    case 'Z': arguments->factory=1; break;
-    case 'z': arguments->reset=1; break;
-    case 'l': arguments->bootloader=1; break;
-    case 'E': arguments->errorno=1; break;
-    case 'w': arguments->watchdog=1; arguments->WDTIM=arg; break;
-    case 'S': arguments->fssd=1; break;
-    case 't': arguments->fssdtimeout=1; arguments->FSSDTIM=arg; break;
-    case 'T': arguments->fssdtype=1; arguments->FSSDACT=arg; break;
-    case 'B': arguments->fssdbatime=1; arguments->BATTIM=arg; break;
-    case 'o': arguments->starttimer=1; arguments->ONTIM=arg; break;
-    case 'O': arguments->stoptimer=1; arguments->OFFTIM=arg; break;
-    case 'L': arguments->lprtimer=1; arguments->LPRTIM=arg; break;
-    case 'r': arguments->relay=1; arguments->RLYSTAT=arg; break;
-    case 'h': arguments->eprlowv=1; arguments->EPRLOWV=arg; break;
-    case 'm': arguments->minlprtime=1; arguments->MINLPRTIM=arg; break;
-    case 'I': arguments->lprcurrent=1; arguments->LPRAMP=arg; break;
-    case 'i': arguments->iomode=1; arguments->IOMODE=arg; break;
-    case 'V': arguments->iovalue=1; break;
     case 'y': arguments->yes=1; break;
     case 'v': arguments->verbose=1; break;
+    case OPT_MAXAGE: arguments->MAXAGE=arg; break;
+    case OPT_SHM: arguments->SHM=arg; break;
+    case OPT_TRANSPORT: arguments->TRANSPORT=arg; break;
+    case OPT_STATS: arguments->stats=1; break;
+    case OPT_ALL: arguments->all=1; break;
+    case OPT_FORMAT: arguments->FORMAT=arg; break;
+    case OPT_WATCH: arguments->WATCH=arg; break;
+    case OPT_HISTORY: arguments->history=1; arguments->RANGE=arg; break;
+    case OPT_RING: arguments->RING=arg; break;
+    case OPT_EVENTS: arguments->events=1; arguments->EVENTINT=arg; break;
+    case OPT_BATLOW: arguments->BATLOW=arg; break;
+    case OPT_HOOK: arguments->HOOK=arg; break;
+    case OPT_NOTIFYFD: arguments->NOTIFYFD=arg; break;
+    case OPT_BUS: arguments->BUS=arg; break;
+    case OPT_BASE: arguments->BASE=arg; break;
+    case OPT_LOCKWAIT: arguments->LOCKWAIT=arg; break;
+    case OPT_TIMEOUT: arguments->TIMEOUT=arg; break;
+    case OPT_RETRIES: arguments->RETRIES=arg; break;
+    case OPT_ADAPTERRETRIES: arguments->ADAPTERRETRIES=arg; break;
+    case OPT_LATENCY: arguments->latency=1; break;
+    case OPT_BATCH: arguments->BATCH=arg; break;
+    case OPT_APPLY: arguments->PROFILE=arg; break;
+    case OPT_DUMPPROFILE: arguments->dumpprofile=1; break;
+    case OPT_KEEPALIVE: arguments->KEEPALIVE=arg; break;
+    case OPT_HEALTH: arguments->HEALTH=arg; break;
+    case OPT_PRIORITY: arguments->PRIORITY=arg; break;
+    case OPT_SAMPLE: arguments->SAMPLE=arg; break;
+    case OPT_RTCEDGE: arguments->rtcedge=1; break;
+    case OPT_RTCSYNC: arguments->RTCSYNC=arg; break;
+    case OPT_RTCCALIBRATE: arguments->CALIBRATE=arg; break;
     default: return ARGP_ERR_UNKNOWN;
   }
   return 0;
 }
+/* PARSER of a --batch line, which only takes the register options, -y and -v */
+static error_t
+parse_line (int key, char *arg, struct argp_state *state)
+{
+  if (key >= OPT_MAXAGE && key <= OPT_RTCCALIBRATE) {
+    argp_error(state, "only the options displaying or setting values, -y and -v can be given in a batch");
+    return EINVAL;
+  }
+  return parse_opt(key, arg, state);
+}
 /* ARGS_DOC. Field 3 in ARGP. A description of the non-option command-line arguments that we accept.  */
 static char args_doc[] = "";
 /* DOC. Field 4 in ARGP. Program documentation. */
 static char doc[] = "A program to control the pimodules (www.pimodules.com) Raspberry Pi UPiS power supply via its PiCo (I2C) inteface.";
 /* The ARGP structure itself. */
 static struct argp argp = {options, parse_opt, args_doc, doc};
+/* The ARGP structure of a --batch line */
+static struct argp lineargp = {options, parse_line, args_doc, doc};
 
 /* Main */
 int main(int argc, char *argv[]) {
 
   struct arguments arguments;
+  static struct upissnapshot snapshot; /* Outlives main for i2ccache */
+  static struct upisjob jobs[UPIS_DEVICES];
+  unsigned int buses[UPIS_DEVICES];
+  unsigned int bases[UPIS_DEVICES];
+  unsigned int nbuses = 1;
+  unsigned int nbases = 1;
+  unsigned int devices = 0;
+  unsigned int device;
+  struct upisplan plan;
+  const struct upisregister *reg;
   char strresp[BUFSIZ]; 
+  unsigned int index;
+  int arg_count = 0;
+  int value;
 
   /* Set ARGP Argument Defaults */
-  arguments.rtc=0;
-  arguments.rtcfactor=0; arguments.RTCF="";
-  arguments.pwrsrc=0;
-  arguments.batvolt=0;
-  arguments.rpivolt=0;
-  arguments.eprvolt=0;
-  arguments.usbvolt=0;
-  arguments.current=0;
-  arguments.centigrade=0;
-  arguments.fahrenheit=0;
-  arguments.fwver=0;
-  arguments.factory=0;
-  arguments.reset=0;
-  arguments.bootloader=0;
-  arguments.errorno=0;
-  arguments.watchdog=0; arguments.WDTIM="";
-  arguments.fssd=0;
-  arguments.fssdtimeout=0; arguments.FSSDTIM="";
-  arguments.fssdtype=0; arguments.FSSDACT="";
-  arguments.fssdbatime=0; arguments.BATTIM="";
-  arguments.starttimer=0; arguments.ONTIM="";
-  arguments.stoptimer=0; arguments.OFFTIM="";
-  arguments.lprtimer=0; arguments.LPRTIM="";
-  arguments.relay=0; arguments.RLYSTAT="";
-  arguments.eprlowv=0; arguments.EPRLOWV="";
-  arguments.minlprtime=0; arguments.MINLPRTIM="";
-  arguments.lprcurrent=0; arguments.LPRAMP="";
-  arguments.iomode=0; arguments.IOMODE="";
-  arguments.iovalue=0;
+  for (index = 0; index < UPIS_REGISTERS; index++) {
+    arguments.flag[index]=0;
+    arguments.arg[index]=NULL;
+  }
   arguments.yes=0;
   arguments.verbose=0;
+  arguments.MAXAGE=NULL;
+  arguments.stats=0;
+  arguments.all=0;
+  arguments.FORMAT="kv";
+  arguments.WATCH=NULL;
+  arguments.history=0; arguments.RANGE=NULL;
+  arguments.RING=UPIS_RING_PATH;
+  arguments.events=0; arguments.EVENTINT=NULL;
+  arguments.BATLOW=NULL;
+  arguments.HOOK=NULL;
+  arguments.NOTIFYFD=NULL;
+  arguments.BUS=NULL;
+  arguments.BASE=NULL;
+  arguments.LOCKWAIT=NULL;
+  arguments.TIMEOUT=NULL;
+  arguments.RETRIES=NULL;
+  arguments.ADAPTERRETRIES=NULL;
+  arguments.latency=0;
+  arguments.BATCH=NULL;
+  arguments.PROFILE=NULL;
+  arguments.dumpprofile=0;
+  arguments.KEEPALIVE=NULL;
+  arguments.HEALTH=NULL;
+  arguments.PRIORITY=NULL;
+  arguments.SAMPLE=NULL;
+  arguments.rtcedge=0;
+  arguments.RTCSYNC=NULL;
+  arguments.CALIBRATE=NULL;
+  arguments.SHM=UPIS_SHM_PATH;
+  arguments.TRANSPORT=getenv(UPIS_TRANSPORT_ENV);
   
   /* Setup ARGP */
+  setoptions();
   argp_parse (&argp, argc, argv, 0, 0, &arguments);
 
-  /* Count the number of arguments specified */
-  int arg_count = arguments.rtc +
-              arguments.rtcfactor + 
-              arguments.pwrsrc +
-              arguments.batvolt +
-              arguments.rpivolt +
-              arguments.eprvolt +
-              arguments.usbvolt +
-              arguments.current +
-              arguments.centigrade +
-              arguments.fahrenheit +
-              arguments.fwver +
-              arguments.factory +
-              arguments.reset +
-              arguments.bootloader +
-              arguments.errorno +
-              arguments.watchdog +
-              arguments.fssd +
-              arguments.fssdtimeout +
-              arguments.fssdtype +
-              arguments.fssdbatime +
-              arguments.starttimer +
-              arguments.stoptimer +
-              arguments.lprtimer +
-              arguments.relay +
-              arguments.eprlowv +
-              arguments.minlprtime +
-              arguments.lprcurrent +
-              arguments.iomode +
-              arguments.iovalue;
-  
-  /* Display the time from the RTC */
-  if (arguments.rtc) {
-    if (arg_count > 1) {
-      printf("RTC Date/Time: ");
-    }
-    printf("%02d-",bcdbyte2dec(readi2cbyte(0x01,0x69,0x04)));
-    printf("%02d-",bcdbyte2dec(readi2cbyte(0x01,0x69,0x05)));
-    printf("20%02d ",bcdbyte2dec(readi2cbyte(0x01,0x69,0x06)));
-    printf("%02d:",bcdbyte2dec(readi2cbyte(0x01,0x69,0x02)));
-    printf("%02d:",bcdbyte2dec(readi2cbyte(0x01,0x69,0x01)));
-    printf("%02d ",bcdbyte2dec(readi2cbyte(0x01,0x69,0x00)));
-    switch (bcdbyte2dec(readi2cbyte(0x01,0x69,0x03)))
-    {
-      case 1: printf("(Sunday)\n"); break;
-      case 2: printf("(Monday)\n"); break;
-      case 3: printf("(Tuesday)\n"); break;
-      case 4: printf("(Wednesday)\n"); break;
-      case 5: printf("(Thursday)\n"); break;
-      case 6: printf("(Friday)\n"); break;
-      case 7: printf("(Saturday)\n"); break;
-    }
-  }
-
-  /* Display/Set RTC correction Factor */
-  if (arguments.rtcfactor) {
-    if (!arguments.RTCF) {
-      if (arg_count > 1) {
-        printf("RTC Correction Factor: ");
-      }
-      printf("%i",readi2cbyte(0x01,0x69,0x07));
-      if (arguments.verbose)
-      {
-        printf(" (0x%02x)",readi2cbyte(0x01,0x69,0x07));
-      }
-      printf("\n");
-    } else {
-      if (is_intstr(arguments.RTCF) && atoi(arguments.RTCF) >= 0 && atoi(arguments.RTCF) <= 255)
-      {
-        writei2cbyte(0x01,0x69,0x07,atoi(arguments.RTCF));
-        printf("RTC Correction Factor set to: %i (0x%02x)\n",readi2cbyte(0x01,0x69,0x07),readi2cbyte(0x01,0x69,0x07));
-      } else {
-        printf("Invalid argument '%s' for RTC clock factor - use an integer between 0 and 255\n",arguments.RTCF);
-      }
+  if (arguments.TRANSPORT && !i2cselect(arguments.TRANSPORT)) {
+    printf("Invalid argument '%s' for transport - use i2c-dev or sim[:LATENCY[:ERRORS]]\n",arguments.TRANSPORT);
+    exit(1);
+  }
+  if (arguments.stats || arguments.latency) {
+    statsstart();
+  }
+  if (arguments.stats) {
+    atexit(statsreport);
+  }
+  if (arguments.latency) {
+    atexit(latencyreport);
+  }
+  if (arguments.TIMEOUT) {
+    if (!is_intstr(arguments.TIMEOUT) || atoi(arguments.TIMEOUT) < 10) {
+      printf("Invalid argument '%s' for timeout - use a number of milliseconds of 10 or more\n",arguments.TIMEOUT);
+      exit(1);
     }
+    i2ctimeout = atoi(arguments.TIMEOUT);
   }
-
-  /* Display Power Source */ 
-  if (arguments.pwrsrc) {
-    if (arguments.verbose) {
-      if (arg_count > 1) {
-        printf("Power source: ");
-      }
-      int i2cresult = readi2cbyte(0x01,0x6A,0x00);
-      if (i2cresult < 1 || i2cresult > 7 ) {
-        printf("Error: Unexpected result for power mode: u\n",i2cresult);
-      } else {
-        switch (i2cresult) {
-          case 1: printf("External Power [EPR]\n"); break;
-          case 2: printf("UPiS USB Power [USB]\n"); break;
-          case 3: printf("Raspberry Pi USB Power [RPI]\n"); break;
-          case 4: printf("Battery Power [BAT]\n"); break;
-          case 5: printf("Low Power [LPR]\n"); break;
-          case 6: printf("[CPR]\n"); break;
-          case 7: printf("[BPR]\n"); break;
-        }
-      }
-    } else {
-      if (arg_count > 1) {
-        printf("Power source: ");
-      }
-      printf("%u\n",readi2cbyte(0x01,0x6A,0x00));
+  if (arguments.RETRIES) {
+    if (!is_intstr(arguments.RETRIES)) {
+      printf("Invalid argument '%s' for retries - use a number of attempts\n",arguments.RETRIES);
+      exit(1);
     }
+    i2cretries = atoi(arguments.RETRIES);
   }
-
-  /* Display the Battery Voltage */
-  if (arguments.batvolt) {
-    if (arg_count > 1) {
-      printf("BAT voltage: ");
+  if (arguments.ADAPTERRETRIES) {
+    if (!is_intstr(arguments.ADAPTERRETRIES)) {
+      printf("Invalid argument '%s' for adapter-retries - use a number of attempts\n",arguments.ADAPTERRETRIES);
+      exit(1);
     }
-    printf("%g",((float)bcdword2dec(readi2cword(0x01,0x6A,0x01))/(float)100));
-    if (arguments.verbose) {
-      printf("V");
+    i2cadapterretries = atoi(arguments.ADAPTERRETRIES);
+  }
+  if (arguments.LOCKWAIT) {
+    if (!is_intstr(arguments.LOCKWAIT)) {
+      printf("Invalid argument '%s' for lock-wait - use a number of milliseconds\n",arguments.LOCKWAIT);
+      exit(1);
     }
-    printf("\n");
+    i2clockwait = atol(arguments.LOCKWAIT);
   }
 
-  /* Display RPI Voltage */
-  if (arguments.rpivolt) {
-    if (arg_count > 1) {
-      printf("RPI Voltage: ");
-    }
-    printf("%g",((float)bcdword2dec(readi2cword(0x01,0x6A,0x03))/(float)100));
-    if (arguments.verbose) {
-      printf("V");
+  /* Every base address on every bus, in list order. The first one is accessed by this thread */
+  buses[0] = i2cdevice.bus;
+  bases[0] = i2cdevice.base;
+  if (arguments.BUS && !(nbuses = parselist(arguments.BUS, buses, 0, 1023))) {
+    printf("Invalid argument '%s' for bus - use a comma separated list of I2C bus numbers\n",arguments.BUS);
+    exit(1);
+  }
+  if (arguments.BASE && !(nbases = parselist(arguments.BASE, bases, 0x03, 0x75))) {
+    printf("Invalid argument '%s' for base-address - use a comma separated list of addresses from 0x03 to 0x75\n",arguments.BASE);
+    exit(1);
+  }
+  if (nbuses * nbases > UPIS_DEVICES) {
+    printf("Error: At most %d PiCo interfaces can be accessed at once\n",UPIS_DEVICES);
+    exit(1);
+  }
+  for (index = 0; index < nbuses; index++) {
+    for (device = 0; device < nbases; device++, devices++) {
+      jobs[devices].device.bus = buses[index];
+      jobs[devices].device.base = bases[device];
     }
-    printf("\n");
   }
+  i2cdevice = jobs[0].device;
 
-  /* Display EPR Voltage */
-  if (arguments.eprvolt) {
-    if (arg_count > 1) {
-      printf("EPR Voltage: ");
-    }
-    printf("%g",((float)bcdword2dec(readi2cword(0x01,0x6A,0x07))/(float)100));
-    if (arguments.verbose) {
-      printf("V");
-    }
-    printf("\n");
+  /* Count the number of arguments specified */
+  for (index = 0; index < UPIS_REGISTERS; index++) {
+    arg_count += arguments.flag[index];
   }
 
-  /* Display USB Voltage */
-  if (arguments.usbvolt) {
-    if (arg_count > 1) {
-      printf("USB Voltage: ");
+  /* Serve reads from the upisd snapshot when it is fresh enough */
+  if (arguments.MAXAGE) {
+    if (!is_intstr(arguments.MAXAGE)) {
+      printf("Invalid argument '%s' for maximum age - use a number of milliseconds\n",arguments.MAXAGE);
+      exit(1);
     }
-    printf("%g",((float)bcdword2dec(readi2cword(0x01,0x6A,0x05))/(float)100));
-    if (arguments.verbose) {
-      printf("V");
+    if (shmread(arguments.SHM, atol(arguments.MAXAGE), &snapshot) &&
+        snapshot.bus == i2cdevice.bus && snapshot.base == i2cdevice.base) {
+      i2ccache = &snapshot;
     }
-    printf("\n");
   }
 
-  /* Current Draw */
-  if (arguments.current) {
-    if (arg_count > 1) {
-      printf("Average Current Draw: ");
+  /* Carry out a file of commands over one session */
+  if (arguments.BATCH) {
+    if (arg_count || arguments.all || arguments.WATCH || arguments.events || arguments.history) {
+      printf("Error: --batch takes the values to display or set from its file, not the command line\n");
+      exit(1);
     }
-    printf("%i",bcdword2dec(readi2cword(0x01,0x6A,0x09)));
-    if (arguments.verbose) {
-      printf("mA");
-    }
-    printf("\n");
+    return runbatch(arguments.BATCH, arguments.TRANSPORT, arguments.yes, arguments.verbose);
   }
-  
-  /* Temp in C */
-  if (arguments.centigrade) {
-    if (arg_count > 1) {
-      printf("Centigrade Temperature: ");
-    }
-    printf("%u",bcdbyte2dec(readi2cbyte(0x01,0x6A,0x0B)));
-    if (arguments.verbose) {
-      printf("C");
-    }
-    printf("\n");
+
+  /* Bring the settings in line with a profile, writing only those that differ */
+  if (arguments.PROFILE) {
+    int values[UPIS_REGISTERS];
+
+    readprofile(arguments.PROFILE, values);
+    i2ccache = NULL;
+    applyprofile(values);
+    return 0;
   }
+  if (arguments.dumpprofile) {
+    dumpprofile();
+    return 0;
+  }
+
+  /* Summarise the recorded history, without touching the bus */
+  if (arguments.history) {
+    struct upishistory history;
+    int64_t from = INT64_MIN;
+    int64_t to = INT64_MAX;
+    char *comma = arguments.RANGE ? strchr(arguments.RANGE, ',') : NULL;
 
-  /* Temp in F */
-  if (arguments.fahrenheit) {
-    if (arg_count > 1) {
-      printf("Fahrenheit Temperature: ");
+    if (comma) {
+      *comma++ = '\0';
     }
-    printf("%u",bcdword2dec(readi2cword(0x01,0x6A,0x0C)));
-    if (arguments.verbose) {
-      printf("F");
+    if ((arguments.RANGE && *arguments.RANGE && !parsehistorytime(arguments.RANGE, &from)) ||
+        (comma && *comma && !parsehistorytime(comma, &to))) {
+      printf("Invalid argument for history range - use FROM[,TO] where each is epoch seconds, YYYY-MM-DDTHH:MM:SS or -N followed by s, m, h or d\n");
+      exit(1);
     }
-    printf("\n");
-  }
-
-  /* Firmware Version */
-  if (arguments.fwver) {
-    if (arg_count > 1) {
-      printf("Firmware Version: ");
+    if (!ringquery(arguments.RING, from, to, &history)) {
+      printf("Error: No history recorded in %s, see upisd --ring\n",arguments.RING);
+      exit(2);
     }
-    printf("%i\n",readi2cword(0x01,0x6B,0x00));
+    printhistory(&history);
+    return 0;
   }
 
-  /* Factory Reset */
-  if (arguments.factory) {
-    if (!arguments.yes) {
-      printf("WARNING: The UPiS will be returned to factory default and reset.\n");
-      printf("This probably isn't a good idea as the Raspberry Pi will also be reset\n");
-      printf("without a file safe shutdown, resulting in possible file system corruption.\n");
-      printf("Type Y/y to proceed: ");
-      scanf("%s",strresp);
+  /* Report power events until interrupted */
+  if (arguments.events) {
+    char *end;
+    double batlow = 0;
+
+    if (arguments.EVENTINT && (!is_intstr(arguments.EVENTINT) || atol(arguments.EVENTINT) < 1)) {
+      printf("Invalid argument '%s' for events interval - use a number of milliseconds greater than 0\n",arguments.EVENTINT);
+      exit(1);
     }
-    if (arguments.yes || strcmp(strresp,"y") == 0 || strcmp(strresp,"Y") == 0)
-    {
-      /* Do the deed */
-      writei2cbyte(0x01,0x69,0x07,0xdd);
-    } else {
-      printf("Factory reset aborted.\n");
+    if (arguments.BATLOW) {
+      batlow = strtod(arguments.BATLOW, &end);
+      if (*end || batlow <= 0 || batlow >= 100) {
+        printf("Invalid argument '%s' for batlow - use a voltage such as 3.6\n",arguments.BATLOW);
+        exit(1);
+      }
     }
+    if (arguments.NOTIFYFD && (!is_intstr(arguments.NOTIFYFD) || fcntl(atoi(arguments.NOTIFYFD), F_GETFD) < 0)) {
+      printf("Invalid argument '%s' for notify-fd - use an open file descriptor\n",arguments.NOTIFYFD);
+      exit(1);
+    }
+    i2ccache = NULL;
+    watchevents(arguments.EVENTINT ? atol(arguments.EVENTINT) : 20, (int)(batlow * 100 + 0.5), arguments.HOOK,
+                arguments.NOTIFYFD ? atoi(arguments.NOTIFYFD) : STDOUT_FILENO);
+    return 0;
   }
 
-  /* Reset */
-  if (arguments.reset) {
-    if (!arguments.yes) {
-      printf("WARNING: The UPiS processor and RTC will be reset.\n");
-      printf("This probably isn't a good idea as the Raspberry Pi will also be reset\n");
-      printf("without a file safe shutdown, resulting in possible file system corruption.\n");
-      printf("Type Y/y to proceed: ");
-      scanf("%s",strresp);
+  /* Keep setting the watchdog timer until interrupted */
+  if (arguments.KEEPALIVE) {
+    char *end;
+    double fraction = 0.5;
+    long timeout = strtol(arguments.KEEPALIVE, &end, 10);
+
+    if (*end == ',') {
+      fraction = strtod(end + 1, &end);
     }
-    if (arguments.yes || strcmp(strresp,"y") == 0 || strcmp(strresp,"Y") == 0)
-    {
-      /* Do the deed */
-      writei2cbyte(0x01,0x69,0x07,0xee);
-    } else {
-      printf("Reset aborted.\n");
-    }
-  }
-
-  /* Bootloader */
-  if (arguments.bootloader) {
-    if (!arguments.yes) {
-      printf("WARNING: The UPiS will be placed in bootloader mode.\n");
-      printf("1. The Red LED on the UPiS will light.\n");
-      printf("2. Recovery from this state is only possible by pressing the RST button\n");
-      printf("   or uploding new firmware.\n");
-      printf("3. Bootloader mode should be used with the RPi firmware upload script.\n");
-      printf("3. All interrupts are disabled during this procedure and the normal\n");
-      printf("   operation of the UPiS is suspended.\n");
-      printf("5. Both the UPiS and RPi must be powered via RPi micro USB during the\n");
-      printf("   boot loading process because the UPiS resets after the firmware is\n");
-      printf("   uploaded.\n");
-      printf("Type Y/y to proceed: ");
-      scanf("%s",strresp);
-    }
-    if (arguments.yes || strcmp(strresp,"y") == 0 || strcmp(strresp,"Y") == 0)
-    {
-      /* Do the deed */
-      writei2cbyte(0x01,0x69,0x07,0xff);
-    } else {
-      printf("Bootloader aborted.\n");
+    if (*end || timeout < 1 || timeout > 254 || fraction <= 0 || fraction >= 1) {
+      printf("Invalid argument '%s' for keepalive - use WDTIM[,FRACTION] where WDTIM is from 1 to 254 seconds and FRACTION is between 0 and 1\n",arguments.KEEPALIVE);
+      exit(1);
     }
-  }
-
-  /* Last Error */
-  if (arguments.errorno) {
-    if (arg_count > 1) {
-      printf("Last Error No: ");
+    if (arguments.HEALTH && healthcheck(arguments.HEALTH, timeout) < 0) {
+      printf("Invalid argument '%s' for health - use pid:PID, pid:PIDFILE or file:PATH\n",arguments.HEALTH);
+      exit(1);
     }
-    printf("%i\n",readi2cbyte(0x01,0x6B,0x01));
+    if (arguments.PRIORITY && (!is_intstr(arguments.PRIORITY) || atoi(arguments.PRIORITY) < 1 || atoi(arguments.PRIORITY) > 99)) {
+      printf("Invalid argument '%s' for priority - use a number from 1 to 99\n",arguments.PRIORITY);
+      exit(1);
+    }
+    i2ccache = NULL;
+    watchkeepalive(timeout, fraction, arguments.HEALTH, arguments.PRIORITY ? atoi(arguments.PRIORITY) : 0, arguments.TRANSPORT);
+    return 0;
   }
 
-  /* Display/Set Watchdog Timer */
-  if (arguments.watchdog) {
-    if (!arguments.WDTIM) {
-      if (arg_count > 1) {
-        printf("Watchdog Timer: ");
-      }
-      printf("%i",readi2cbyte(0x01,0x6B,0x02));
-      if (arguments.verbose)
-      {
-        printf(" (0x%02x)",readi2cbyte(0x01,0x6B,0x02));
-      }
-      printf("\n");
-    } else {
-      if (is_intstr(arguments.WDTIM) && atoi(arguments.WDTIM) >= 0 && atoi(arguments.WDTIM) <= 255)
-      {
-        writei2cbyte(0x01,0x6B,0x02,atoi(arguments.WDTIM));
-        printf("Watchdog Timer set to: %i (0x%02x)\n",readi2cbyte(0x01,0x6B,0x02),readi2cbyte(0x01,0x6B,0x02));
-      } else {
-        printf("Invalid argument '%s' for watchdog timer - use an integer between 0 and 255\n",arguments.WDTIM);
-      }
+  /* Sample the status page as fast as the bus allows until interrupted */
+  if (arguments.SAMPLE) {
+    char *end;
+    double window = strtod(arguments.SAMPLE, &end);
+
+    if (*end || window <= 0) {
+      printf("Invalid argument '%s' for sample window - use a number of seconds greater than 0\n",arguments.SAMPLE);
+      exit(1);
     }
+    i2ccache = NULL;
+    watchsamples(window);
+    return 0;
   }
 
-  /* File Safe Shutdown [FSSD] */
-  if (arguments.fssd) {
-    writei2cbyte(0x01,0x6B,0x02,0x00);
-    printf("File safe shutdown initiated\n");
+  /* Time the RTC against the system clock */
+  if (arguments.rtcedge || arguments.RTCSYNC || arguments.CALIBRATE) {
+    i2ccache = NULL;
   }
+  if (arguments.rtcedge) {
+    struct timespec monotonic;
+    struct timespec realtime;
+    long long uncertainty;
+    time_t rtc = rtcedge(&monotonic, &realtime, &uncertainty);
 
-  /* Display/Set FSSD Timer */
-  if (arguments.fssdtimeout) {
-    if (!arguments.FSSDTIM) {
-      if (arg_count > 1) {
-        printf("File Safe Shutdown Timer: ");
-      }
-      printf("%i",readi2cbyte(0x01,0x6B,0x03));
-      if (arguments.verbose)
-      {
-        printf(" (0x%02x)",readi2cbyte(0x01,0x6B,0x03));
-      }
-      printf("\n");
-    } else {
-      if (is_intstr(arguments.FSSDTIM) && atoi(arguments.FSSDTIM) >= 15 && atoi(arguments.FSSDTIM) <= 255)
-      {
-        writei2cbyte(0x01,0x6B,0x03,atoi(arguments.FSSDTIM));
-        printf("File Safe Shutdown Timer set to: %i (0x%02x)\n",readi2cbyte(0x01,0x6B,0x03),readi2cbyte(0x01,0x6B,0x03));
-      } else {
-        printf("Invalid argument '%s' for file safe shutdown timer - use an integer between 15 and 255\n",arguments.FSSDTIM);
-      }
-    }
+    printedge(rtc, &realtime, uncertainty, NULL);
+    return 0;
   }
-
-  /* Display/Set FSSD Type */
-  if (arguments.fssdtype) {
-    if (!arguments.FSSDACT) {
-      if (arg_count > 1) {
-        printf("File Safe Shutdown Type: ");
-      }
-      printf("%i",readi2cbyte(0x01,0x6B,0x04));
-      if (arguments.verbose)
-      {
-        printf(" (0x%02x)",readi2cbyte(0x01,0x6B,0x04));
-      }
-      printf("\n");
-    } else {
-      if (is_intstr(arguments.FSSDACT) && atoi(arguments.FSSDACT) >= 0 && atoi(arguments.FSSDACT) <= 2)
-      {
-        writei2cbyte(0x01,0x6B,0x04,atoi(arguments.FSSDACT));
-        printf("File Safe Shutdown Type set to: %i (0x%02x)\n",readi2cbyte(0x01,0x6B,0x04),readi2cbyte(0x01,0x6B,0x04));
-      } else {
-        printf("Invalid argument '%s' for file safe shutdown type - use an integer between 0 and 2\n",arguments.FSSDACT);
-      }
+  if (arguments.RTCSYNC) {
+    if (strcmp(arguments.RTCSYNC,"system") != 0 && strcmp(arguments.RTCSYNC,"rtc") != 0) {
+      printf("Invalid argument '%s' for rtc-sync - use system or rtc\n",arguments.RTCSYNC);
+      exit(1);
     }
+    rtcsync(arguments.RTCSYNC);
+    return 0;
   }
+  if (arguments.CALIBRATE) {
+    char *comma = strchr(arguments.CALIBRATE, ',');
+    long duration;
+    long interval = 60;
 
-  /* Display/Set FSSD Battery Mode Timer */
-  if (arguments.fssdbatime) {
-    if (!arguments.BATTIM) {
-      if (arg_count > 1) {
-        printf("File Safe Shutdown BAT Timer: ");
-      }
-      printf("%i",readi2cbyte(0x01,0x6B,0x05));
-      if (arguments.verbose)
-      {
-        printf(" (0x%02x)",readi2cbyte(0x01,0x6B,0x05));
-      }
-      printf("\n");
-    } else {
-      if (is_intstr(arguments.BATTIM) && atoi(arguments.BATTIM) >= 0 && atoi(arguments.BATTIM) <= 255)
-      {
-        writei2cbyte(0x01,0x6B,0x05,atoi(arguments.BATTIM));
-        printf("File Safe Shutdown BAT Timer set to: %i (0x%02x)\n",readi2cbyte(0x01,0x6B,0x05),readi2cbyte(0x01,0x6B,0x05));
-      } else {
-        printf("Invalid argument '%s' for file safe shutdown BAT timer - use an integer between 0 and 255\n",arguments.BATTIM);
-      }
+    if (comma) {
+      *comma++ = '\0';
+      interval = is_intstr(comma) ? atol(comma) : 0;
     }
+    duration = parseduration(arguments.CALIBRATE);
+    if (duration <= 0 || interval < 3) {
+      printf("Invalid argument for rtc-calibrate - use DURATION[,INTERVAL] where DURATION is a number of seconds, or minutes, hours or days followed by m, h or d, and INTERVAL is 3 seconds or more\n");
+      exit(1);
+    }
+    rtccalibrate(duration, interval, arguments.yes);
+    return 0;
   }
 
-  /* Start Timer */
-  if (arguments.starttimer) {
-    printf("*** Not implemented yet ***\n");
+  if ((arguments.all || arguments.WATCH) && strcmp(arguments.FORMAT,"kv") != 0 &&
+      strcmp(arguments.FORMAT,"json") != 0 && strcmp(arguments.FORMAT,"csv") != 0) {
+    printf("Invalid argument '%s' for format - use kv, json or csv\n",arguments.FORMAT);
+    exit(1);
   }
 
-  /* Stop Timer */
-  if (arguments.stoptimer) {
-    printf("*** Not implemented yet ***\n");
-  }
+  /* Stream the selected values until interrupted */
+  if (arguments.WATCH) {
+    const char *names[UPIS_FIELDS];
+    int count = 0;
+    int pages = 0;
+    char *end;
+    double interval = strtod(arguments.WATCH, &end);
 
-  /* LPR Wekeup Polling Timer */
-  if (arguments.lprtimer) {
-    if (!arguments.LPRTIM) {
-      if (arg_count > 1) {
-        printf("LPR Wakeup Polling Timer: ");
-      }
-      printf("%i",readi2cbyte(0x01,0x6B,0x0A));
-      if (arguments.verbose)
-      {
-        printf(" (0x%02x)",readi2cbyte(0x01,0x6B,0x0A));
-      }
-      printf("\n");
-    } else {
-      if (is_intstr(arguments.LPRTIM) && atoi(arguments.LPRTIM) >= 0 && atoi(arguments.LPRTIM) <= 255)
-      {
-        writei2cbyte(0x01,0x6B,0x0A,atoi(arguments.LPRTIM));
-        printf("LPR Wakeup Polling Timer set to: %i (0x%02x)\n",readi2cbyte(0x01,0x6B,0x0A),readi2cbyte(0x01,0x6B,0x0A));
-      } else {
-        printf("Invalid argument '%s' for LPR Wakeup Polling timer - use an integer between 0 and 255\n",arguments.LPRTIM);
-      }
+    if (*end || interval <= 0) {
+      printf("Invalid argument '%s' for watch interval - use a number of seconds greater than 0\n",arguments.WATCH);
+      exit(1);
     }
-  }
-
-  /* Relay Control */
-  if (arguments.relay) {
-    if (!arguments.RLYSTAT) {
-      if (arg_count > 1) {
-        printf("Relay Status: ");
+    names[count++] = "time";
+    for (index = 0; index < UPIS_REGISTERS; index++) {
+      reg = &upisregisters[index];
+      if (!arguments.flag[index]) {
+        continue;
       }
-      if (arguments.verbose)
-      {
-        if (readi2cbyte(0x01,0x6B,0x0B) == 0) {
-          printf("on/closed");
-        } else {
-          printf("off/open");
-        }
-      } else {
-        printf("%i",readi2cbyte(0x01,0x6B,0x0B));
-       /* Relay Reversal Mod */
-    /* if (readi2cbyte(0x01,0x6B,0x0B) == 0) {
-          printf("%i",1);
-        } else {
-          printf("%i",0);
-   }*/
+      if (reg->kind == UPIS_KIND_ACTION || (arguments.arg[index] && registersets(reg))) {
+        printf("Error: --watch only displays values, it cannot be combined with setting them\n");
+        exit(1);
       }
-      printf("\n");
-    } else {
-      strlower(arguments.RLYSTAT);
-      if (strcmp(arguments.RLYSTAT,"closed") == 0 || strcmp(arguments.RLYSTAT,"1") == 0 || strcmp(arguments.RLYSTAT,"on") == 0) {
-        writei2cbyte(0x01,0x6B,0x0B,0x01);
-        printf("Relay set to: on/closed\n");
-      } else if (strcmp(arguments.RLYSTAT,"open") == 0 || strcmp(arguments.RLYSTAT,"0") == 0 || strcmp(arguments.RLYSTAT,"off") == 0) {
-        writei2cbyte(0x01,0x6B,0x0B,0x00);
-        printf("Relay set to: off/open\n");
-      } else {
-        printf("Invalid argument '%s' for relay state - use 0,1,open,closed,off or on\n",arguments.RLYSTAT);
+      if (reg->kind != UPIS_KIND_TODO) {
+        names[count++] = reg->name;
+        pages |= 1 << UPIS_PLAN_PAGE(reg->addr); /* UPIS_PAGE_RTC, _STATUS or _CONFIG */
       }
     }
+    names[count] = NULL;
+    if (arguments.all) {
+      pages = UPIS_PAGE_ALL;
+    } else if (!pages) {
+      printf("Error: --watch needs at least one value to display\n");
+      exit(1);
+    }
+    i2ccache = NULL;
+    watchpages(pages, arguments.all ? NULL : names, arguments.FORMAT, interval,
+               arguments.MAXAGE ? arguments.SHM : NULL, arguments.MAXAGE ? atol(arguments.MAXAGE) : 0);
+    return 0;
   }
 
-  /* EPR Switch to battery Threshold */
-  if (arguments.eprlowv) {
-    printf("*** Not implemented yet ***\n");
-  }
-
-  /* EPR Hysteresis */
-  if (arguments.minlprtime) {
-    printf("*** Not implemented yet ***\n");
+  /* Display everything as one machine readable record */
+  if (arguments.all && devices > 1) {
+    statssection("all");
+    for (device = 0; device < devices; device++) {
+      jobs[device].all = 1;
+    }
+    runjobs(jobs, devices);
+    for (device = 0; device < devices; device++) {
+      printrecord(&jobs[device].snapshot, arguments.FORMAT, NULL, 1);
+    }
+    return 0;
   }
-
-  /* LPR Switch Current Threshold */
-  if (arguments.lprcurrent) {
-    printf("*** Not implemented yet ***\n");
+  if (arguments.all) {
+    statssection("all");
+    if (!i2ccache) {
+      readsnapshot(&snapshot);
+    }
+    printrecord(&snapshot, arguments.FORMAT, NULL, 0);
+    return 0;
   }
 
-  /* IO Pin Function */
-  if (arguments.iomode) {
-    if (!arguments.IOMODE) {
-      if (arg_count > 1) {
-        printf("IO Pin Mode: ");
-      }
-      printf("%i",readi2cbyte(0x01,0x6B,0x10));
-      if (arguments.verbose)
-      {
-        printf(" (0x%02x)",readi2cbyte(0x01,0x6B,0x10));
+  /* Plan every register access up front: each register is read once, before any write,
+     and every register written is read back once after all the writes. The writes are
+     queued first, so a value spanning a written register, such as the IO pin value with
+     the IO pin mode, is read after the writes as it was before the plan */
+  statssection("plan");
+  planinit(&plan);
+  for (index = 0; index < UPIS_REGISTERS; index++) {
+    reg = &upisregisters[index];
+    if (!arguments.flag[index] || reg->kind == UPIS_KIND_TODO) {
+      continue;
+    }
+    if (reg->kind == UPIS_KIND_ACTION) {
+      if (reg->confirm && !arguments.yes) {
+        printf("%s",reg->confirm);
+        printf("Type Y/y to proceed: ");
+        scanf("%s",strresp);
       }
-      printf("\n");
-    } else {
-      if (is_intstr(arguments.IOMODE) && atoi(arguments.IOMODE) >= 0 && atoi(arguments.IOMODE) <= 3)
+      if (!reg->confirm || arguments.yes || strcmp(strresp,"y") == 0 || strcmp(strresp,"Y") == 0)
       {
-        writei2cbyte(0x01,0x6B,0x10,atoi(arguments.IOMODE));
-        printf("IP Pin Mode set to: %i (0x%02x)\n",readi2cbyte(0x01,0x6B,0x10),readi2cbyte(0x01,0x6B,0x10));
+        /* Do the deed */
+        planwrite(&plan,reg->addr,reg->reg,reg->min,0);
       } else {
-        printf("Invalid argument '%s' for io pin mode - use an integer between 0 and 3\n",arguments.IOMODE);
+        printf("%s aborted.\n",reg->what);
       }
+    } else if (arguments.arg[index] && registersets(reg)) {
+      if (registerparse(reg,arguments.arg[index],&value)) {
+        planwrite(&plan,reg->addr,reg->reg,value,reg->kind != UPIS_KIND_RELAY);
+      }
+    }
+  }
+  for (index = 0; index < UPIS_REGISTERS; index++) {
+    reg = &upisregisters[index];
+    if (arguments.flag[index] && reg->kind != UPIS_KIND_TODO && reg->kind != UPIS_KIND_ACTION &&
+        !(arguments.arg[index] && registersets(reg))) {
+      planread(&plan,reg->addr,reg->reg,reg->len);
+    }
+  }
+  if (devices > 1) {
+    /* The same plan is carried out on every device, each bus by its own thread */
+    for (device = 0; device < devices; device++) {
+      jobs[device].plan = plan;
     }
+    runjobs(jobs, devices);
+  } else {
+    runplan(&plan);
+    jobs[0].plan = plan;
   }
 
-  /* IO Pin Value */
-  if (arguments.iovalue) {
-    int i2cresult = readi2cbyte(0x01,0x6B,0x10);
-    if (i2cresult < 0 || i2cresult > 3 ) {
-      printf("Error: Unexpected io pin mode: %i\n",i2cresult);
-    } else if (i2cresult == 0) {
-        printf("IO Pin mode is not set\n");
-    } else {
-      if (arguments.verbose || arg_count > 1) {
-        printf("IO Pin Value: ");
-      }
-      switch (i2cresult) {
-        case 1: /* 1 wire temp value (word) */
-                printf("%i",readi2cword(0x01,0x6B,0x11));
-                break;
-        case 2: /* 8 bit A/D value (byte) */
-                printf("%i",readi2cbyte(0x01,0x6B,0x11));
-                break;
-        case 3: /* Staus of forced on-change (byte?) */
-                printf("%i",readi2cbyte(0x01,0x6B,0x11));
-                break;
+  /* Render every requested option from the values fetched */
+  for (device = 0; device < devices; device++) {
+    if (devices > 1) {
+      printf("Bus %u address 0x%02x:\n",jobs[device].device.bus,jobs[device].device.base);
+    }
+    for (index = 0; index < UPIS_REGISTERS; index++) {
+      reg = &upisregisters[index];
+      if (arguments.flag[index]) {
+        statssection(reg->name);
+        registerprint(reg, reg->addr ? jobs[device].plan.value[UPIS_PLAN_PAGE(reg->addr)] : NULL, arguments.arg[index],
+                      arguments.verbose, arg_count > 1);
       }
-      printf("\n");
     }
   }
 
+  statssection(NULL);
   return 0;
 }
 
-/* Converts a string to lowercase */
-void strlower(char *string)
+/* Longest line of a --batch file, options on one line and display only lines read together */
+#define UPIS_BATCH_LINE 512
+#define UPIS_BATCH_ARGS 64
+#define UPIS_BATCH_PENDING 32
+
+/* A line of a --batch file, parsed as the options of one upis command */
+struct batchline {
+  unsigned int number;
+  char text[2 * UPIS_BATCH_LINE];  /* Options, with -- added to those given without dashes */
+  struct arguments arguments;
+  int count;                        /* Number of register options */
+  int valid;
+};
+
+/* Parses a --batch line. Returns 1 when it holds options, 0 when they are invalid and -1 when there are none */
+static int batchparse(struct batchline *line, char *input, int yes, int verbose)
 {
-  while(*string) {
-    if (*string >= 'A' && *string <= 'Z' ) {
-      *string = *string + 32;
+  char *argv[UPIS_BATCH_ARGS + 1];
+  char *text = line->text;
+  char *word;
+  unsigned int index;
+  int argc = 0;
+
+  memset(&line->arguments, 0, sizeof(line->arguments));
+  line->arguments.yes = yes;
+  line->arguments.verbose = verbose;
+  argv[argc++] = "upis";
+  for (word = strtok(input, " \t\r\n"); word && *word != '#'; word = strtok(NULL, " \t\r\n")) {
+    if (argc == UPIS_BATCH_ARGS) {
+      return 0;
     }
-    string++;
+    argv[argc++] = text;
+    text += sprintf(text, "%s%s", *word == '-' ? "" : "--", word) + 1;
+  }
+  if (argc == 1) {
+    return -1;
+  }
+  argv[argc] = NULL;
+  if (argp_parse(&lineargp, argc, argv, ARGP_NO_EXIT | ARGP_NO_HELP, 0, &line->arguments) != 0) {
+    return 0;
+  }
+  line->count = 0;
+  for (index = 0; index < UPIS_REGISTERS; index++) {
+    line->count += line->arguments.flag[index];
   }
+  return 1;
 }
 
-/* Tests if a string is a valid representation of and integer */ 
-int is_intstr(char *intstr) 
+/* Returns 1 when a --batch line sets values or carries out an action */
+static int batchwrites(const struct batchline *line)
 {
-  int counter;  
-  /* No strings that start with 0i allowed */
-  if (intstr[0] == 48 && strlen(intstr) > 1) { return 0; }
-  /* Are all the chars in the string numric? */
-  for(counter = 0; counter < strlen(intstr); counter++)
-  {
-    if (intstr[counter] < 48 || intstr[counter] > 57) { return 0; }
+  unsigned int index;
+
+  for (index = 0; index < UPIS_REGISTERS; index++) {
+    if (line->arguments.flag[index] && (upisregisters[index].kind == UPIS_KIND_ACTION ||
+        (line->arguments.arg[index] && registersets(&upisregisters[index])))) {
+      return 1;
+    }
   }
-  return 1;
+  return 0;
 }
 
-/* Procedure to read and retun an 8 bit (byte) integer from an I2C register at a given I2C address on a given I2C bus */
-int readi2cbyte(unsigned int i2cbus, unsigned int i2caddr, unsigned int i2creg)
+/* Checks the values a --batch line sets and adds its register accesses to plan.
+   Returns 0, with the reason, when the line cannot be carried out */
+static int batchplan(struct upisplan *plan, struct batchline *line, char *reason, size_t size)
 {
-  int i2cfile;
-  char i2cdev[20];
+  const struct upisregister *reg;
+  unsigned int index;
+  int value;
 
-  snprintf(i2cdev, 19, "/dev/i2c-%d", i2cbus);
-  i2cfile = open(i2cdev, O_RDWR);
-  if (i2cfile < 0)
-  {
-    /* Unable to open I2C device */
-    printf("Error: Unable to open i2c bus %u\n",i2cbus);
-    exit(1);
+  for (index = 0; index < UPIS_REGISTERS; index++) {
+    reg = &upisregisters[index];
+    if (!line->arguments.flag[index] || reg->kind == UPIS_KIND_TODO) {
+      continue;
+    }
+    if (reg->kind == UPIS_KIND_ACTION && reg->confirm && !line->arguments.yes) {
+      snprintf(reason, size, "%s needs -y to proceed without prompting", reg->what);
+      return 0;
+    }
+    if (reg->kind != UPIS_KIND_ACTION && line->arguments.arg[index] && registersets(reg) &&
+        !registerparse(reg, line->arguments.arg[index], &value)) {
+      if (reg->kind == UPIS_KIND_RELAY) {
+        snprintf(reason, size, "Invalid argument '%s' for %s - use 0,1,open,closed,off or on",line->arguments.arg[index],reg->what);
+      } else {
+        snprintf(reason, size, "Invalid argument '%s' for %s - use an integer between %i and %i",line->arguments.arg[index],reg->what,reg->min,reg->max);
+      }
+      return 0;
+    }
   }
-
-  if (ioctl(i2cfile, I2C_SLAVE, i2caddr) < 0)
-  {
-    /* Unable to read the PiCO interface */
-    printf("Error: Unable to access the PiCO interface at address 0x%02x\n",i2cbus);
-    exit(2);
+  for (index = 0; index < UPIS_REGISTERS; index++) {
+    reg = &upisregisters[index];
+    if (!line->arguments.flag[index] || reg->kind == UPIS_KIND_TODO) {
+      continue;
+    }
+    if (reg->kind == UPIS_KIND_ACTION) {
+      planwrite(plan,reg->addr,reg->reg,reg->min,0);
+    } else if (line->arguments.arg[index] && registersets(reg)) {
+      registerparse(reg,line->arguments.arg[index],&value);
+      planwrite(plan,reg->addr,reg->reg,value,reg->kind != UPIS_KIND_RELAY);
+    }
   }
-
-  __u8 i2c_register = i2creg; /* Device register to access */
-  __s32 i2cresult;
-  char buf[10];
-
-  i2cresult = i2c_smbus_read_byte_data(i2cfile, i2c_register);
-  if (i2cresult < 0 )
-  {
-    printf("Error: Unexpected result: u\n",i2cresult);
-    exit(2);
+  /* Reads after the writes, see planread */
+  for (index = 0; index < UPIS_REGISTERS; index++) {
+    reg = &upisregisters[index];
+    if (line->arguments.flag[index] && reg->kind != UPIS_KIND_TODO && reg->kind != UPIS_KIND_ACTION &&
+        !(line->arguments.arg[index] && registersets(reg))) {
+      planread(plan,reg->addr,reg->reg,reg->len);
+    }
   }
-  return i2cresult;
+  return 1;
 }
 
-/* Procedure to read and retun an 16 bit (word) integer from an I2C register at a given I2C address on a given I2C bus */
-int readi2cword(unsigned int i2cbus, unsigned int i2caddr, unsigned int i2creg)
+/* Carries out --batch lines as one plan, displays their values and reports the status of each.
+   Returns the exit code: 0 when every line succeeded, 1 when one was invalid and 2 when the bus failed */
+static int batchrun(struct upis *upis, const char *name, struct batchline *lines, unsigned int count)
 {
-  int i2cfile;
-  char i2cdev[20];
+  const struct upisregister *reg;
+  struct upisplan plan;
+  char reason[128];
+  unsigned int counter;
+  unsigned int index;
+  unsigned int valid = 0;
+  int status = 0;
 
-  snprintf(i2cdev, 19, "/dev/i2c-%d", i2cbus);
-  i2cfile = open(i2cdev, O_RDWR);
-  if (i2cfile < 0)
-  {
-    /* Unable to open I2C device */
-    printf("Error: Unable to open i2c bus %u\n",i2cbus);
-    exit(1);
+  planinit(&plan);
+  for (counter = 0; counter < count; counter++) {
+    lines[counter].valid = batchplan(&plan, &lines[counter], reason, sizeof(reason));
+    if (!lines[counter].valid) {
+      fprintf(stderr, "%s:%u: %s\n",name,lines[counter].number,reason);
+      status = 1;
+    }
+    valid += lines[counter].valid;
   }
-
-  if (ioctl(i2cfile, I2C_SLAVE, i2caddr) < 0)
-  {
-    /* Unable to read the PiCO interface */
-    printf("Error: Unable to access the PiCO interface at address 0x%02x\n",i2cbus);
-    exit(2);
+  if (!valid) {
+    return status;
   }
-
-  __u8 i2c_register = i2creg; /* Device register to access */
-  __s32 i2cresult;
-  char buf[10];
-
-  i2cresult = i2c_smbus_read_word_data(i2cfile, i2c_register);
-  if (i2cresult < 0 )
-  {
-    printf("Error: Unexpected result: %u\n",i2cresult);
-    exit(2);
+  if (upisrunplan(upis, &plan) < 0) {
+    for (counter = 0; counter < count; counter++) {
+      if (lines[counter].valid) {
+        fprintf(stderr, "%s:%u: %s\n",name,lines[counter].number,upiserror(upis));
+      }
+    }
+    return 2;
+  }
+  for (counter = 0; counter < count; counter++) {
+    if (!lines[counter].valid) {
+      continue;
+    }
+    for (index = 0; index < UPIS_REGISTERS; index++) {
+      reg = &upisregisters[index];
+      if (lines[counter].arguments.flag[index]) {
+        statssection(reg->name);
+        registerprint(reg, reg->addr ? plan.value[UPIS_PLAN_PAGE(reg->addr)] : NULL, lines[counter].arguments.arg[index],
+                      lines[counter].arguments.verbose, lines[counter].count > 1);
+      }
+    }
+    statssection(NULL);
+    fflush(stdout);
+    fprintf(stderr, "%s:%u: ok\n",name,lines[counter].number);
   }
-  return i2cresult;
+  return status;
 }
 
-/* Procedure to write a 8 bit (byte) inetger to an I2C register at a giving I2C address on a given I2C bus */
-void writei2cbyte(unsigned int i2cbus, unsigned int i2caddr, unsigned int i2creg, unsigned int i2cval)
+/* Carries out a file of upis commands, one per line, over one session on the first interface.
+   Consecutive lines that only display values share one plan, and so one read of the bus */
+int runbatch(const char *path, const char *transport, int yes, int verbose)
 {
-  int i2cfile;
-  char i2cdev[20];
+  static struct batchline lines[UPIS_BATCH_PENDING];
+  const char *name = strcmp(path,"-") == 0 ? "stdin" : path;
+  FILE *file = strcmp(path,"-") == 0 ? stdin : fopen(path,"r");
+  char input[UPIS_BATCH_LINE];
+  struct upis *upis;
+  unsigned int number = 0;
+  unsigned int pending = 0;
+  int status = 0;
+  int result;
+  int c;
 
-  snprintf(i2cdev, 19, "/dev/i2c-%d", i2cbus);
-  i2cfile = open(i2cdev, O_RDWR);
-  if (i2cfile < 0)
-  {
-    /* Unable to open I2C device */
-    printf("Error: Unable to open i2c bus %u\n",i2cbus);
+  if (!file) {
+    printf("Error: Unable to open batch file %s\n",path);
     exit(1);
   }
-
-  if (ioctl(i2cfile, I2C_SLAVE, i2caddr) < 0)
-  {
-    /* Unable to read the PiCO interface */
-    printf("Error: Unable to access the PiCO interface at address 0x%02x\n",i2cbus);
+  upis = upisopen(i2cdevice.bus, i2cdevice.base, transport);
+  if (!upis) {
+    printf("Error: %s\n",upiserror(NULL));
     exit(2);
   }
-
-  __u8 i2c_register = i2creg; /* Device register to access */
-  __s32 i2cresult;
-  char buf[1] = { i2cval };
-  i2cresult = i2c_smbus_write_byte_data(i2cfile, i2c_register, buf[0]);
-  if (i2cresult < 0 ) {
-    printf("Error: Unexpected result %i\n",i2cresult);
+  while (fgets(input, sizeof(input), file)) {
+    number++;
+    if (!strchr(input, '\n') && !feof(file)) {
+      while ((c = fgetc(file)) != EOF && c != '\n') {
+      }
+      fprintf(stderr, "%s:%u: Line longer than %d characters\n",name,number,UPIS_BATCH_LINE - 2);
+      status = status > 1 ? status : 1;
+      continue;
+    }
+    result = batchparse(&lines[pending], input, yes, verbose);
+    if (result < 0) {
+      continue;
+    }
+    lines[pending].number = number;
+    if (!result) {
+      fprintf(stderr, "%s:%u: Invalid options\n",name,number);
+      status = status > 1 ? status : 1;
+      continue;
+    }
+    if (batchwrites(&lines[pending])) {
+      /* Reads queued before a write show the values from before it */
+      result = batchrun(upis, name, lines, pending);
+      status = result > status ? result : status;
+      result = batchrun(upis, name, &lines[pending], 1);
+      pending = 0;
+    } else if (++pending == UPIS_BATCH_PENDING) {
+      result = batchrun(upis, name, lines, pending);
+      pending = 0;
+    } else {
+      continue;
+    }
+    status = result > status ? result : status;
+  }
+  result = batchrun(upis, name, lines, pending);
+  status = result > status ? result : status;
+  if (file != stdin) {
+    fclose(file);
   }
+  upisclose(upis);
+  return status;
 }
+#endif
 
-/* Takes an unsigned int (16 bit) in Binary Coded Decimal (BCD) and returns a regular integer */
-int bcdword2dec(unsigned int bcd)
+#ifdef UPISD
+/* Socket answering queries when upisd is run with --socket */
+#define UPISD_SOCKET_PATH "/run/upis.sock"
+/* Group allowed to query the socket unless --group names another */
+#define UPISD_SOCKET_GROUP "i2c"
+/* Daemon ARGP Argument and Parameters */
+struct arguments {
+  int foreground;   /* The -f   & --foreground flag */
+  char *INTERVAL;   /* Argument for -i */
+  char *SHM;        /* Argument for -m */
+  char *TRANSPORT;  /* Argument for -t */
+  char *RING;       /* Argument for -r */
+  char *RECORDS;    /* Argument for -n */
+  char *EVERY;      /* Argument for -e */
+  char *SYNC;       /* Argument for -s */
+  char *SOCKET;     /* Argument for -S */
+  char *GROUP;      /* Argument for -g */
+  char *MAXAGE;     /* Argument for -a */
+  char *TIMEOUT;    /* Argument for -T */
+  char *RETRIES;    /* Argument for -R */
+};
+/* OPTIONS.  Field 1 in ARGP. Order of fields: {NAME, KEY, ARG, FLAGS, DOC}. */
+static struct argp_option options[] =
 {
-  int a;
-  int b;
-  int c;
-  int d;
-  a = (bcd >> 12)&0x000F;
-  b = (bcd >> 8)&0x000F;
-  c = (bcd >> 4)&0x000F;
-  d = bcd&0x000F;
-  return((a*1000)+(b*100)+(c*10)+d);
-}
-
-/* Takes an unsigned small int (8 bit) in Binary Coded Decimal (BCD) and returns a regular integer */
-int bcdbyte2dec(unsigned int bcd)
+  {"interval",'i',"INTERVAL",0,"Poll the PiCo interface every INTERVAL milliseconds. Default is 1000"},
+  {"ring",'r',"RING",0,"Record the status values in the history file RING for upis --history, for example " UPIS_RING_PATH ". Not recorded by default"},
+  {"records",'n',"RECORDS",0,"Number of records kept in a new history file, the oldest are overwritten first. Default is 40320"},
+  {"every",'e',"EVERY",0,"Record the status values every EVERY seconds. Default is 60"},
+  {"sync",'s',"SYNC",0,"Write recorded values out to the history file at most every SYNC seconds, to keep flash writes low. Values not yet written are lost on power failure. Default is 600"},
+  {"socket",'S',"SOCKET",0,"Answer queries on the Unix socket SOCKET, for example " UPISD_SOCKET_PATH ". A query is one line naming values as upis --all does, separated by spaces, or all; the answer is one line of name=value pairs, starting with stale=1 when the last poll of the PiCo interface failed, or error=... Not served by default"},
+  {"group",'g',"GROUP",0,"Let the members of GROUP query the socket, which no one else but root can. Default is " UPISD_SOCKET_GROUP ", the group of the I2C devices on Raspberry Pi OS, or root only when there is no such group"},
+  {"max-age",'a',"MAXAGE",0,"Answer socket queries from the latest values when they are no older than MAXAGE milliseconds, otherwise poll the PiCo interface once for all the queries waiting. Default is 500"},
+  {"timeout",'T',"TIMEOUT",0,"Have the I2C adapter give up on a transaction after TIMEOUT milliseconds, see upis --timeout. Default is to leave the adapter as it is"},
+  {"retries",'R',"RETRIES",0,"Attempt a failed transaction up to RETRIES more times, see upis --retries. Default is 2"},
+  {"foreground",'f',0,0,"Stay in the foreground rather than detaching from the terminal"},
+  {"shm",'m',"SHM",0,"Publish the latest values for upis --max-age and other readers in SHM. Default is " UPIS_SHM_PATH},
+  {"transport",'t',"TRANSPORT",0,"Access the PiCo interface through TRANSPORT: i2c-dev or sim[:LATENCY[:ERRORS]], see upis --help. Defaults to the " UPIS_TRANSPORT_ENV " environment variable, or i2c-dev"},
+  {0}
+};
+/* PARSER. Field 2 in ARGP. Order of parameters: KEY, ARG, STATE. */
+static error_t
+parse_opt (int key, char *arg, struct argp_state *state)
 {
-  int a;
-  int b;
-  a = (bcd >> 4)&0x000F;
-  b = bcd&0x000F;
-  return((a*10)+b);
+  struct arguments *arguments = state->input;
+  switch (key) {
+    case 'i': arguments->INTERVAL=arg; break;
+    case 'f': arguments->foreground=1; break;
+    case 'm': arguments->SHM=arg; break;
+    case 't': arguments->TRANSPORT=arg; break;
+    case 'r': arguments->RING=arg; break;
+    case 'n': arguments->RECORDS=arg; break;
+    case 'e': arguments->EVERY=arg; break;
+    case 's': arguments->SYNC=arg; break;
+    case 'S': arguments->SOCKET=arg; break;
+    case 'g': arguments->GROUP=arg; break;
+    case 'a': arguments->MAXAGE=arg; break;
+    case 'T': arguments->TIMEOUT=arg; break;
+    case 'R': arguments->RETRIES=arg; break;
+    default: return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+/* ARGS_DOC. Field 3 in ARGP. A description of the non-option command-line arguments that we accept.  */
+static char args_doc[] = "";
+/* DOC. Field 4 in ARGP. Program documentation. */
+static char doc[] = "A daemon that keeps the pimodules (www.pimodules.com) Raspberry Pi UPiS PiCo (I2C) interface open, polls its RTC, status and config pages and keeps the latest values in memory, for upis --max-age and socket queries. Send SIGUSR1 to display the latest values, or SIGUSR2 the latency of the transactions at each register, when running in the foreground.";
+/* The ARGP structure itself. */
+static struct argp argp = {options, parse_opt, args_doc, doc};
+
+/* Set from the signal handler, acted upon by the polling loop */
+static volatile sig_atomic_t daemon_stop = 0;
+static volatile sig_atomic_t daemon_dump = 0;
+static volatile sig_atomic_t daemon_latency = 0;
+
+/* Socket query clients */
+#define UPISD_CLIENTS 64
+#define UPISD_REQUEST 256
+#define UPISD_EVENTS 16
+struct upisdclient {
+  int file;                   /* -1 when the slot is free */
+  int waiting;                /* A complete query waits for an answer */
+  unsigned int length;
+  char request[UPISD_REQUEST];
+};
+static struct upisdclient daemon_clients[UPISD_CLIENTS];
+
+/* Signal handler for SIGTERM, SIGINT, SIGUSR1 and SIGUSR2 */
+static void daemon_signal(int sig)
+{
+  if (sig == SIGUSR1) {
+    daemon_dump = 1;
+  } else if (sig == SIGUSR2) {
+    daemon_latency = 1;
+  } else {
+    daemon_stop = 1;
+  }
+}
+
+/* Creates the query socket at path, replacing a stale one, and returns it listening. Only root
+   and the members of group may connect; a missing group is an error unless required is 0 */
+static int daemon_listen(const char *path, const char *group, int required)
+{
+  struct sockaddr_un address;
+  struct group *entry;
+  gid_t gid = 0;
+  int listener;
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    printf("Error: Socket path %s is too long\n",path);
+    exit(1);
+  }
+  strcpy(address.sun_path, path);
+  entry = getgrnam(group);
+  if (entry) {
+    gid = entry->gr_gid;
+  } else if (required) {
+    printf("Error: No group named %s\n",group);
+    exit(1);
+  }
+  unlink(path);
+  listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      chown(path, -1, gid) < 0 || chmod(path, 0660) < 0 || listen(listener, UPISD_CLIENTS) < 0) {
+    printf("Error: Unable to listen on socket %s\n",path);
+    exit(1);
+  }
+  return listener;
+}
+
+/* Adds a descriptor to the epoll set for input */
+static void daemon_watch(int epoll, int file)
+{
+  struct epoll_event event;
+
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = file;
+  if (epoll_ctl(epoll, EPOLL_CTL_ADD, file, &event) < 0) {
+    printf("Error: Unable to watch descriptor %d\n",file);
+    exit(1);
+  }
+}
+
+/* Accepts every pending connection, dropping those beyond UPISD_CLIENTS */
+static void daemon_accept(int epoll, int listener)
+{
+  int file;
+  int counter;
+
+  while ((file = accept(listener, NULL, NULL)) >= 0) {
+    fcntl(file, F_SETFL, O_NONBLOCK);
+    fcntl(file, F_SETFD, FD_CLOEXEC);
+    for (counter = 0; counter < UPISD_CLIENTS && daemon_clients[counter].file >= 0; counter++) {
+    }
+    if (counter == UPISD_CLIENTS) {
+      close(file);
+      continue;
+    }
+    daemon_clients[counter].file = file;
+    daemon_clients[counter].waiting = 0;
+    daemon_clients[counter].length = 0;
+    daemon_watch(epoll, file);
+  }
+}
+
+/* Closing the descriptor also removes it from the epoll set */
+static void daemon_drop(struct upisdclient *client)
+{
+  close(client->file);
+  client->file = -1;
+  client->waiting = 0;
+}
+
+/* Reads what a client has sent, marking it waiting once a query line is complete */
+static void daemon_receive(int file)
+{
+  struct upisdclient *client = NULL;
+  ssize_t length;
+  int counter;
+
+  for (counter = 0; counter < UPISD_CLIENTS; counter++) {
+    if (daemon_clients[counter].file == file) {
+      client = &daemon_clients[counter];
+    }
+  }
+  if (!client) {
+    return;
+  }
+  length = read(file, client->request + client->length, UPISD_REQUEST - 1 - client->length);
+  if (length < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+  if (length <= 0) {
+    daemon_drop(client);
+    return;
+  }
+  client->length += length;
+  if (memchr(client->request, '\n', client->length)) {
+    client->waiting = 1;
+  } else if (client->length == UPISD_REQUEST - 1) {
+    send(file, "error=query too long\n", 21, MSG_NOSIGNAL);
+    daemon_drop(client);
+  }
+}
+
+/* Returns 1 when any client has a query waiting */
+static int daemon_waiting(void)
+{
+  int counter;
+
+  for (counter = 0; counter < UPISD_CLIENTS; counter++) {
+    if (daemon_clients[counter].file >= 0 && daemon_clients[counter].waiting) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Appends a name=value pair to a reply of length characters, leaving room for the newline.
+   Returns 0, leaving the reply as it was, when the pair does not fit */
+static int daemon_append(char *reply, size_t size, int *length, const struct upisfield *field)
+{
+  int added;
+
+  added = snprintf(reply + *length, size - *length, "%s%s=%s", *length ? " " : "", field->name, field->value);
+  if (added < 0 || (size_t)added >= size - *length - 1) {
+    reply[*length] = '\0';
+    return 0;
+  }
+  *length += added;
+  return 1;
+}
+
+/* Reports a failure or recovery of the polling, with its reason unless NULL, on stderr in the
+   foreground and to syslog otherwise */
+static void daemon_log(int foreground, int priority, const char *message, const char *reason)
+{
+  if (foreground) {
+    fprintf(stderr, "%s%s%s\n", message, reason ? ": " : "", reason ? reason : "");
+  } else {
+    syslog(priority, "%s%s%s", message, reason ? ": " : "", reason ? reason : "");
+  }
+}
+
+/* Answers every complete query of the waiting clients from snapshot. When the last poll failed,
+   stale gives the reason: answers then start with stale=1, or are error=... without any snapshot */
+static void daemon_answer(const struct upissnapshot *snapshot, const char *stale)
+{
+  struct upisfield fields[UPIS_FIELDS];
+  struct upisdclient *client;
+  char reply[UPIS_FIELDS * 48];
+  char *line;
+  char *name;
+  char *save;
+  char *end;
+  int count = 0;
+  int length;
+  int fits;
+  int counter;
+  int index;
+
+  for (counter = 0; counter < UPISD_CLIENTS; counter++) {
+    client = &daemon_clients[counter];
+    while (client->file >= 0 && client->waiting && (end = memchr(client->request, '\n', client->length))) {
+      if (!count) {
+        count = snapshotfields(snapshot, fields);
+      }
+      *end = '\0';
+      line = client->request;
+      length = 0;
+      reply[0] = '\0';
+      if (stale && !snapshot->pages) {
+        length = snprintf(reply, sizeof(reply), "error=%s", stale);
+        line = NULL;
+      } else if (stale) {
+        length = snprintf(reply, sizeof(reply), "stale=1");
+      }
+      for (name = line ? strtok_r(line, " ,\t\r", &save) : NULL; name; name = strtok_r(NULL, " ,\t\r", &save)) {
+        for (index = 0; index < count && strcmp(name, fields[index].name) != 0; index++) {
+        }
+        fits = 1;
+        if (strcmp(name, "all") == 0) {
+          for (index = 0; index < count && fits; index++) {
+            fits = daemon_append(reply, sizeof(reply), &length, &fields[index]);
+          }
+        } else if (index < count) {
+          fits = daemon_append(reply, sizeof(reply), &length, &fields[index]);
+        } else {
+          length = snprintf(reply, sizeof(reply), "error=unknown value %.64s", name);
+          break;
+        }
+        if (!fits) {
+          length = snprintf(reply, sizeof(reply), "error=answer too long");
+          break;
+        }
+      }
+      if (!length) {
+        length = snprintf(reply, sizeof(reply), "error=no value named");
+      }
+      reply[length++] = '\n';
+      client->length -= end + 1 - client->request;
+      memmove(client->request, end + 1, client->length);
+      if (send(client->file, reply, length, MSG_NOSIGNAL) != length) {
+        daemon_drop(client);
+      }
+    }
+    client->waiting = 0;
+  }
+}
+
+/* Main */
+int main(int argc, char *argv[]) {
+
+  struct arguments arguments;
+  struct upissnapshot snapshot;
+  struct upissnapshot fresh;
+  struct upis *upis;
+  struct upisshm *shm;
+  static struct upisring ring;
+  struct sigaction action;
+  struct epoll_event events[UPISD_EVENTS];
+  struct timespec now;
+  struct timespec record;
+  struct timespec sync;
+  uint64_t expirations;
+  long interval;
+  long maxage;
+  int recorded = 0;
+  int stale = 0;
+  int listener = -1;
+  int timerfile;
+  int epoll;
+  int ready;
+  int poll;
+  int counter;
+
+  /* Set ARGP Argument Defaults */
+  arguments.foreground=0;
+  arguments.INTERVAL="1000";
+  arguments.SHM=UPIS_SHM_PATH;
+  arguments.TRANSPORT=getenv(UPIS_TRANSPORT_ENV);
+  arguments.RING=NULL;
+  arguments.RECORDS="40320";
+  arguments.EVERY="60";
+  arguments.SYNC="600";
+  arguments.SOCKET=NULL;
+  arguments.GROUP=NULL;
+  arguments.MAXAGE="500";
+  arguments.TIMEOUT=NULL;
+  arguments.RETRIES=NULL;
+
+  /* Setup ARGP */
+  argp_parse (&argp, argc, argv, 0, 0, &arguments);
+
+  if (arguments.TRANSPORT && !i2cselect(arguments.TRANSPORT)) {
+    printf("Invalid argument '%s' for transport - use i2c-dev or sim[:LATENCY[:ERRORS]]\n",arguments.TRANSPORT);
+    exit(1);
+  }
+
+  if (!is_intstr(arguments.INTERVAL) || atol(arguments.INTERVAL) < 1) {
+    printf("Invalid argument '%s' for poll interval - use a number of milliseconds greater than 0\n",arguments.INTERVAL);
+    exit(1);
+  }
+  interval = atol(arguments.INTERVAL);
+
+  if (!is_intstr(arguments.RECORDS) || atol(arguments.RECORDS) < 1) {
+    printf("Invalid argument '%s' for records - use a number greater than 0\n",arguments.RECORDS);
+    exit(1);
+  }
+  if (!is_intstr(arguments.EVERY) || atol(arguments.EVERY) < 1) {
+    printf("Invalid argument '%s' for record interval - use a number of seconds greater than 0\n",arguments.EVERY);
+    exit(1);
+  }
+  if (!is_intstr(arguments.SYNC)) {
+    printf("Invalid argument '%s' for sync interval - use a number of seconds\n",arguments.SYNC);
+    exit(1);
+  }
+  if (!is_intstr(arguments.MAXAGE)) {
+    printf("Invalid argument '%s' for max-age - use a number of milliseconds\n",arguments.MAXAGE);
+    exit(1);
+  }
+  maxage = atol(arguments.MAXAGE);
+  if (arguments.TIMEOUT) {
+    if (!is_intstr(arguments.TIMEOUT) || atoi(arguments.TIMEOUT) < 10) {
+      printf("Invalid argument '%s' for timeout - use a number of milliseconds of 10 or more\n",arguments.TIMEOUT);
+      exit(1);
+    }
+    i2ctimeout = atoi(arguments.TIMEOUT);
+  }
+  if (arguments.RETRIES) {
+    if (!is_intstr(arguments.RETRIES)) {
+      printf("Invalid argument '%s' for retries - use a number of attempts\n",arguments.RETRIES);
+      exit(1);
+    }
+    i2cretries = atoi(arguments.RETRIES);
+  }
+
+  /* Latency is recorded throughout, for SIGUSR2 */
+  statsstart();
+
+  /* Polls run in a session, so a failed one is reported rather than ending the daemon */
+  upis = upisopen(i2cdevice.bus, i2cdevice.base, arguments.TRANSPORT);
+  if (!upis) {
+    printf("Error: %s\n",upiserror(NULL));
+    exit(1);
+  }
+
+  shm = shmcreate(arguments.SHM);
+  if (arguments.RING) {
+    ringcreate(&ring, arguments.RING, atol(arguments.RECORDS));
+  }
+  if (arguments.SOCKET) {
+    listener = daemon_listen(arguments.SOCKET, arguments.GROUP ? arguments.GROUP : UPISD_SOCKET_GROUP, arguments.GROUP != NULL);
+  }
+
+  if (!arguments.foreground && daemon(0,0) < 0) {
+    printf("Error: Unable to detach from the terminal\n");
+    exit(1);
+  }
+  if (!arguments.foreground) {
+    openlog("upisd", LOG_PID, LOG_DAEMON);
+  }
+
+  /* No SA_RESTART, so a signal cuts the wait for work short */
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = daemon_signal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGUSR1, &action, NULL);
+  sigaction(SIGUSR2, &action, NULL);
+
+  /* Poll on the periodic timer, so the interval does not drift, and serve the socket in between */
+  memset(&snapshot, 0, sizeof(snapshot));
+  for (counter = 0; counter < UPISD_CLIENTS; counter++) {
+    daemon_clients[counter].file = -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &sync);
+  record = sync;
+  epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll < 0) {
+    printf("Error: Unable to create the epoll set\n");
+    exit(1);
+  }
+  timerfile = watchtimer(interval / 1000.0);
+  daemon_watch(epoll, timerfile);
+  if (listener >= 0) {
+    daemon_watch(epoll, listener);
+  }
+
+  while (!daemon_stop) {
+    ready = epoll_wait(epoll, events, UPISD_EVENTS, -1);
+    if (ready < 0) {
+      if (daemon_dump) {
+        daemon_dump = 0;
+        printsnapshot(&snapshot);
+      }
+      if (daemon_latency) {
+        daemon_latency = 0;
+        latencyreport();
+      }
+      continue;
+    }
+    poll = 0;
+    for (counter = 0; counter < ready; counter++) {
+      if (events[counter].data.fd == timerfile) {
+        /* Polls missed while busy are skipped rather than made in a burst */
+        poll = read(timerfile, &expirations, sizeof(expirations)) == sizeof(expirations);
+      } else if (events[counter].data.fd == listener) {
+        daemon_accept(epoll, listener);
+      } else {
+        daemon_receive(events[counter].data.fd);
+      }
+    }
+
+    /* A stale snapshot is refreshed once for all the queries waiting, however many there are.
+       When the bus fails the last snapshot is kept, and is not published again, so readers of
+       the shared memory see it age and fall back to the bus */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (poll || (daemon_waiting() && (!snapshot.pages || elapsedns(&snapshot.monotonic, &now) > maxage * 1000000LL))) {
+      if (upisreadsnapshot(upis, &fresh) < 0) {
+        if (!stale) {
+          daemon_log(arguments.foreground, LOG_WARNING, "Unable to poll the PiCo interface, serving the last values as stale", upiserror(upis));
+        }
+        stale = 1;
+        daemon_answer(&snapshot, upiserror(upis));
+        continue;
+      }
+      if (stale) {
+        daemon_log(arguments.foreground, LOG_NOTICE, "Polling the PiCo interface again", NULL);
+      }
+      stale = 0;
+      snapshot = fresh;
+      shmpublish(shm, &snapshot);
+      if (arguments.RING && (!recorded || elapsedns(&record, &snapshot.monotonic) >= atol(arguments.EVERY) * 1000000000LL)) {
+        recorded = 1;
+        record = snapshot.monotonic;
+        ringappend(&ring, &snapshot);
+      }
+      if (arguments.RING && elapsedns(&sync, &snapshot.monotonic) >= atol(arguments.SYNC) * 1000000000LL) {
+        sync = snapshot.monotonic;
+        ringflush(&ring);
+      }
+    }
+    daemon_answer(&snapshot, stale ? upiserror(upis) : NULL);
+  }
+
+  if (arguments.SOCKET) {
+    unlink(arguments.SOCKET);
+  }
+
+  if (arguments.RING) {
+    ringflush(&ring);
+  }
+  upisclose(upis);
+  return 0;
+}
+#endif
+
+/* Converts a string to lowercase */
+void strlower(char *string)
+{
+  while(*string) {
+    if (*string >= 'A' && *string <= 'Z' ) {
+      *string = *string + 32;
+    }
+    string++;
+  }
+}
+
+/* Tests if a string is a valid representation of and integer */ 
+int is_intstr(char *intstr) 
+{
+  int counter;  
+  /* No strings that start with 0i allowed */
+  if (intstr[0] == 48 && strlen(intstr) > 1) { return 0; }
+  /* Are all the chars in the string numric? */
+  for(counter = 0; counter < strlen(intstr); counter++)
+  {
+    if (intstr[counter] < 48 || intstr[counter] > 57) { return 0; }
+  }
+  return 1;
+}
+
+/* Displays every value held in a snapshot in "Label: value" format */
+void printsnapshot(const struct upissnapshot *snapshot)
+{
+  struct upisfield fields[UPIS_FIELDS];
+  int count = snapshotfields(snapshot, fields);
+  int counter;
+
+  for (counter = 1; counter < count; counter++) {
+    if (registerfind(fields[counter].name)) {
+      printf("%s: %s\n", registerfind(fields[counter].name)->label, fields[counter].value);
+    }
+  }
+  fflush(stdout);
+}
+
+/* Displays a snapshot as one record in kv, json or csv format. Returns 0 for an unknown format.
+   names is a NULL terminated list of the fields to display, NULL for all of them. When streaming,
+   kv records are kept to one line and the csv header is only displayed with the first record */
+int printrecord(const struct upissnapshot *snapshot, const char *format, const char **names, int stream)
+{
+  static int headers = 0;
+  struct upisfield all[UPIS_FIELDS];
+  struct upisfield fields[UPIS_FIELDS];
+  int total = snapshotfields(snapshot, all);
+  int count = 0;
+  int counter;
+  int index;
+
+  for (counter = 0; counter < total; counter++) {
+    for (index = 0; names && names[index] && strcmp(names[index], all[counter].name) != 0; index++) {
+    }
+    if (!names || names[index]) {
+      fields[count++] = all[counter];
+    }
+  }
+
+  if (strcmp(format, "kv") == 0) {
+    for (counter = 0; counter < count; counter++) {
+      printf("%s%s=%s", counter && stream ? " " : "", fields[counter].name, fields[counter].value);
+      if (!stream) {
+        printf("\n");
+      }
+    }
+    if (stream) {
+      printf("\n");
+    }
+  } else if (strcmp(format, "json") == 0) {
+    printf("{");
+    for (counter = 0; counter < count; counter++) {
+      printf(fields[counter].isstring ? "%s\"%s\":\"%s\"" : "%s\"%s\":%s", counter ? "," : "", fields[counter].name, fields[counter].value);
+    }
+    printf("}\n");
+  } else if (strcmp(format, "csv") == 0) {
+    if (!stream || !headers++) {
+      for (counter = 0; counter < count; counter++) {
+        printf("%s%s", counter ? "," : "", fields[counter].name);
+      }
+      printf("\n");
+    }
+    for (counter = 0; counter < count; counter++) {
+      printf("%s%s", counter ? "," : "", strcmp(fields[counter].value, "null") ? fields[counter].value : "");
+    }
+    printf("\n");
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+/* Samples the selected pages every interval seconds and streams one record per sample, until interrupted.
+   The schedule is kept by a periodic timerfd so it does not drift with the time taken to sample.
+   With shmpath set, samples come from the upisd snapshot whenever it is no older than maxage */
+void watchpages(int pages, const char **names, const char *format, double interval, const char *shmpath, long maxage)
+{
+  struct upissnapshot snapshot;
+  uint64_t expirations;
+  int timerfile = watchtimer(interval);
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  while (read(timerfile, &expirations, sizeof(expirations)) == sizeof(expirations) || errno == EINTR) {
+    if (!shmpath || !shmread(shmpath, maxage, &snapshot)) {
+      readpages(&snapshot, pages);
+    }
+    printrecord(&snapshot, format, names, 1);
+  }
+  close(timerfile);
+}
+
+/* Returns a timerfd that expires now and then every interval seconds */
+int watchtimer(double interval)
+{
+  struct itimerspec timer;
+  int timerfile;
+
+  timerfile = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (timerfile < 0) {
+    printf("Error: Unable to create the watch timer\n");
+    exit(1);
+  }
+  timer.it_interval.tv_sec = (time_t)interval;
+  timer.it_interval.tv_nsec = (long)((interval - (time_t)interval) * 1e9);
+  if (timer.it_interval.tv_sec == 0 && timer.it_interval.tv_nsec == 0) {
+    timer.it_interval.tv_nsec = 1;
+  }
+  timer.it_value.tv_sec = 0;
+  timer.it_value.tv_nsec = 1;
+  if (timerfd_settime(timerfile, 0, &timer, NULL) < 0) {
+    printf("Error: Unable to start the watch timer\n");
+    exit(1);
+  }
+  return timerfile;
+}
+
+/* Polls the power source register every interval milliseconds, and the battery voltage with it when
+   batlow is set (in 1/100 Volts), and reports each change of power source and each fall of the
+   battery below batlow through sendevent. Each poll is a single small transaction, so the detection
+   latency is about one interval while the process sleeps in between. The first poll only sets the
+   starting state. Runs until interrupted */
+void watchevents(long interval, int batlow, const char *hook, int notifyfd)
+{
+  struct sigaction action;
+  unsigned char page[3];
+  uint64_t expirations;
+  int timerfile;
+  int pwrsrc = -1;
+  int batvolt = 0;
+  int armed = 1;
+
+  /* Hooks are not waited for, let the kernel reap them; a closed notification pipe is not fatal */
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = SIG_IGN;
+  action.sa_flags = SA_NOCLDWAIT;
+  sigaction(SIGCHLD, &action, NULL);
+  action.sa_flags = 0;
+  sigaction(SIGPIPE, &action, NULL);
+
+  timerfile = watchtimer(interval / 1000.0);
+  while (read(timerfile, &expirations, sizeof(expirations)) == sizeof(expirations) || errno == EINTR) {
+    readi2cblock(i2cdevice.bus,0x6A,0x00,batlow ? 3 : 1,page);
+    if (batlow) {
+      batvolt = bcdword2dec(page[0x01] | (page[0x02] << 8));
+    }
+    if (pwrsrc >= 0 && page[0x00] != pwrsrc) {
+      sendevent("pwrsrc", pwrsrcname(pwrsrc), pwrsrcname(page[0x00]), batvolt, hook, notifyfd);
+    }
+    pwrsrc = page[0x00];
+    if (batlow && armed && batvolt < batlow) {
+      armed = 0;
+      sendevent("batlow", NULL, NULL, batvolt, hook, notifyfd);
+    } else if (batlow && batvolt >= batlow + UPIS_BATLOW_HYSTERESIS) {
+      armed = 1;
+    }
+  }
+  close(timerfile);
+}
+
+/* Set by SIGINT and SIGTERM to end --keepalive and --sample */
+static volatile sig_atomic_t watchstop = 0;
+
+static void watchsignal(int sig)
+{
+  watchstop = 1;
+}
+
+/* Sets the watchdog timer to timeout seconds every fraction of timeout while the health check passes.
+   Each wakeup is one write transaction. The timer slack lets the kernel merge wakeups with other
+   timers within a quarter of the time to spare; a real time priority overrides the slack and, with
+   the memory locked, keeps load from delaying the writes. A failed write, such as one kept waiting
+   by another upis holding the bus, is reported and attempted again every UPIS_KEEPALIVE_RETRY
+   milliseconds rather than ending the keepalive. Disables the watchdog when interrupted */
+void watchkeepalive(int timeout, double fraction, const char *health, int priority, const char *transport)
+{
+  const struct timespec pause = { 0, UPIS_KEEPALIVE_RETRY * 1000000L };
+  struct sigaction action;
+  struct sched_param param;
+  struct upis *upis;
+  uint64_t expirations;
+  int timerfile;
+  int healthy = 1;
+  int attempt;
+
+  upis = upisopen(i2cdevice.bus, i2cdevice.base, transport);
+  if (!upis) {
+    printf("Error: %s\n",upiserror(NULL));
+    exit(1);
+  }
+
+  if (priority) {
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0 || sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+      printf("Error: Unable to run at real time priority %i: %s\n",priority,strerror(errno));
+      exit(1);
+    }
+  }
+  prctl(PR_SET_TIMERSLACK, (unsigned long)(timeout * (1 - fraction) * 1e9 / 4), 0, 0, 0);
+
+  /* Without SA_RESTART, so the signal interrupts the wait on the timer */
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = watchsignal;
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGINT, &action, NULL);
+
+  timerfile = watchtimer(timeout * fraction);
+  while (!watchstop) {
+    if (read(timerfile, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (expirations > 1) {
+      fprintf(stderr, "Watchdog timer set late, %llu wakeups missed\n",(unsigned long long)expirations - 1);
+    }
+    if (health && !healthcheck(health, timeout)) {
+      if (healthy) {
+        fprintf(stderr, "Health check %s failed, the watchdog timer is no longer set\n",health);
+      }
+      healthy = 0;
+      continue;
+    }
+    if (!healthy) {
+      fprintf(stderr, "Health check %s passed, setting the watchdog timer again\n",health);
+    }
+    healthy = 1;
+    while (!keepalivewrite(upis, timeout) && !watchstop) {
+      nanosleep(&pause, NULL);
+    }
+  }
+  close(timerfile);
+  for (attempt = 0; !keepalivewrite(upis, 0xFF); attempt++) {
+    if (attempt == UPIS_KEEPALIVE_STOPS) {
+      printf("Error: The watchdog timer is still set\n");
+      exit(2);
+    }
+    nanosleep(&pause, NULL);
+  }
+  upisclose(upis);
+}
+
+/* Writes value to the watchdog timer in one transaction. Returns 0, having reported why, when the
+   bus fails */
+int keepalivewrite(struct upis *upis, int value)
+{
+  struct upisplan plan;
+
+  planinit(&plan);
+  planwrite(&plan, 0x6B, 0x02, value, 0);
+  if (upisrunplan(upis, &plan) < 0) {
+    fprintf(stderr, "Unable to set the watchdog timer: %s\n",upiserror(upis));
+    return 0;
+  }
+  return 1;
+}
+
+/* Reads the status page as fast as the bus allows into a ring, for samplestats to summarise.
+   This thread only reads and stores, and a full ring drops samples rather than waiting, so
+   the bus is never held up by the statistics or their display. Runs until interrupted */
+void watchsamples(double window)
+{
+  static struct samplering ring;
+  struct sigaction action;
+  struct upissample *sample;
+  unsigned char scratch[0x0A];
+  pthread_t thread;
+  uint64_t head = 0;
+
+  ring.window = window;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = watchsignal;
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGINT, &action, NULL);
+  if (pthread_create(&thread, NULL, samplestats, &ring) != 0) {
+    printf("Error: Unable to start the statistics thread\n");
+    exit(1);
+  }
+  while (!watchstop) {
+    if (head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) == UPIS_SAMPLE_RING) {
+      __atomic_fetch_add(&ring.dropped, 1, __ATOMIC_RELAXED);
+      readi2cblock(i2cdevice.bus,0x6A,0x01,0x0A,scratch);
+      continue;
+    }
+    sample = &ring.sample[head % UPIS_SAMPLE_RING];
+    readi2cblock(i2cdevice.bus,0x6A,0x01,0x0A,&sample->page[0x01]);
+    clock_gettime(CLOCK_MONOTONIC, &sample->time);
+    __atomic_store_n(&ring.head, ++head, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&ring.done, 1, __ATOMIC_RELEASE);
+  pthread_join(thread, NULL);
+}
+
+/* Takes the samples of the ring in order and displays the statistics of each window of them,
+   and of the last partial window. Percentiles come from a histogram of every possible value,
+   so memory is fixed and they are exact */
+void *samplestats(void *data)
+{
+  static const char *names[UPIS_SAMPLE_VALUES] = {"current", "batvolt", "rpivolt", "eprvolt", "usbvolt"};
+  static unsigned int histogram[UPIS_SAMPLE_VALUES][UPIS_SAMPLE_MAX];
+  static const int percents[3] = {50, 90, 99};
+  struct samplering *ring = data;
+  const struct upisregister *regs[UPIS_SAMPLE_VALUES];
+  const struct upissample *sample;
+  struct timespec pause = {0, 2000000};
+  struct timespec start;
+  struct timespec last;
+  struct timespec now;
+  unsigned long count = 0;
+  uint64_t tail = 0;
+  uint64_t dropped = 0;
+  uint64_t lost;
+  double mean[UPIS_SAMPLE_VALUES];
+  double m2[UPIS_SAMPLE_VALUES];
+  int min[UPIS_SAMPLE_VALUES];
+  int max[UPIS_SAMPLE_VALUES];
+  int percentile[3];
+  unsigned long seen;
+  double span;
+  double delta;
+  int value;
+  int done;
+  int index;
+  int counter;
+
+  for (index = 0; index < UPIS_SAMPLE_VALUES; index++) {
+    regs[index] = registerfind(names[index]);
+  }
+  while (1) {
+    done = __atomic_load_n(&ring->done, __ATOMIC_ACQUIRE);
+    if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+      if (!done) {
+        nanosleep(&pause, NULL);
+        continue;
+      }
+      sample = NULL;
+    } else {
+      sample = &ring->sample[tail % UPIS_SAMPLE_RING];
+    }
+
+    /* Display the window the sample falls beyond, or the last one */
+    if (count && (!sample || elapsedns(&start, &sample->time) >= (long long)(ring->window * 1e9))) {
+      clock_gettime(CLOCK_REALTIME, &now);
+      lost = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+      span = sample || count < 2 ? ring->window : elapsedns(&start, &last) / 1e9;
+      for (index = 0; index < UPIS_SAMPLE_VALUES; index++) {
+        for (counter = 0, seen = 0, value = 0; counter < 3; counter++) {
+          while (seen < (count * percents[counter] + 99) / 100) {
+            seen += histogram[index][value++];
+          }
+          percentile[counter] = value - 1;
+        }
+        printf("time=%lld.%03ld name=%s samples=%lu rate=%.1f dropped=%llu min=%g max=%g mean=%.3f stddev=%.3f p50=%g p90=%g p99=%g\n",
+               (long long)now.tv_sec,now.tv_nsec / 1000000,names[index],count,count / span,
+               (unsigned long long)(lost - dropped),(double)min[index] / regs[index]->scale,(double)max[index] / regs[index]->scale,
+               mean[index] / regs[index]->scale,sqrt(count > 1 ? m2[index] / (count - 1) : 0) / regs[index]->scale,
+               (double)percentile[0] / regs[index]->scale,(double)percentile[1] / regs[index]->scale,
+               (double)percentile[2] / regs[index]->scale);
+      }
+      fflush(stdout);
+      dropped = lost;
+      count = 0;
+      memset(histogram, 0, sizeof(histogram));
+    }
+    if (!sample) {
+      break;
+    }
+
+    /* Welford's running mean and sum of squared differences */
+    if (!count) {
+      start = sample->time;
+    }
+    last = sample->time;
+    count++;
+    for (index = 0; index < UPIS_SAMPLE_VALUES; index++) {
+      value = registervalue(regs[index], sample->page);
+      if (value < 0 || value >= UPIS_SAMPLE_MAX) {
+        value = UPIS_SAMPLE_MAX - 1;
+      }
+      if (count == 1) {
+        min[index] = max[index] = value;
+        mean[index] = m2[index] = 0;
+      }
+      min[index] = value < min[index] ? value : min[index];
+      max[index] = value > max[index] ? value : max[index];
+      delta = value - mean[index];
+      mean[index] += delta / count;
+      m2[index] += delta * (value - mean[index]);
+      histogram[index][value]++;
+    }
+    __atomic_store_n(&ring->tail, ++tail, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+/* Displays a timing of the RTC seconds: the system time they changed at, the RTC time they changed to,
+   how far the system clock is ahead and the uncertainty of the timing, in seconds, followed by extra */
+void printedge(time_t rtc, const struct timespec *realtime, long long uncertainty, const char *extra)
+{
+  double offset = (double)(realtime->tv_sec - rtc) + realtime->tv_nsec / 1e9;
+
+  printf("time=%lld.%03ld rtc=%lld offset=%+.4f uncertainty=%.4f%s%s\n",(long long)realtime->tv_sec,realtime->tv_nsec / 1000000,
+         (long long)rtc,offset,uncertainty / 1e9,extra && *extra ? " " : "",extra ? extra : "");
+  fflush(stdout);
+}
+
+/* Sets the system clock from the RTC, at the time its seconds change, or the RTC from the system clock,
+   as the system clock starts a second */
+void rtcsync(const char *to)
+{
+  struct timespec monotonic;
+  struct timespec realtime;
+  struct timespec now;
+  long long uncertainty;
+  long long ns;
+  struct tm local;
+  time_t rtc;
+
+  if (strcmp(to,"system") == 0) {
+    rtc = rtcedge(&monotonic, &realtime, &uncertainty);
+    printedge(rtc, &realtime, uncertainty, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = elapsedns(&monotonic, &now);
+    now.tv_sec = rtc + ns / 1000000000LL;
+    now.tv_nsec = ns % 1000000000LL;
+    if (clock_settime(CLOCK_REALTIME, &now) < 0) {
+      printf("Error: Unable to set the system clock: %s\n",strerror(errno));
+      exit(2);
+    }
+    printf("System clock set from the RTC\n");
+    return;
+  }
+  clock_gettime(CLOCK_REALTIME, &now);
+  now.tv_sec++;
+  now.tv_nsec = 0;
+  while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &now, NULL) == EINTR) {
+  }
+  localtime_r(&now.tv_sec, &local);
+  writertc(&local);
+  printf("RTC set from the system clock\n");
+  rtc = rtcedge(&monotonic, &realtime, &uncertainty);
+  printedge(rtc, &realtime, uncertainty, NULL);
+}
+
+/* Times the RTC every interval seconds for duration seconds, or until interrupted, and fits the RTC time
+   against CLOCK_MONOTONIC by least squares to find the drift, then recommends the correction factor
+   cancelling it, and sets it when apply is set. CLOCK_MONOTONIC is not stepped when the system clock is
+   set, but runs at the rate NTP disciplines the system clock to, when it is running */
+void rtccalibrate(long duration, long interval, int apply)
+{
+  struct sigaction action;
+  struct timespec monotonic;
+  struct timespec first;
+  struct timespec realtime;
+  uint64_t expirations;
+  long long uncertainty;
+  time_t rtc;
+  time_t rtcfirst = 0;
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+  double x, y;
+  double drift = 0;
+  double residual;
+  char extra[32];
+  int count = 0;
+  int current;
+  int factor;
+  int timerfile;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = watchsignal;
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGINT, &action, NULL);
+
+  timerfile = watchtimer(interval);
+  while (!watchstop) {
+    if (read(timerfile, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    rtc = rtcedge(&monotonic, &realtime, &uncertainty);
+    if (!count) {
+      first = monotonic;
+      rtcfirst = rtc;
+    }
+    /* Seconds the RTC has gained on CLOCK_MONOTONIC since the first timing */
+    x = elapsedns(&first, &monotonic) / 1e9;
+    y = (double)(rtc - rtcfirst) - x;
+    count++;
+    sx += x;
+    sy += y;
+    sxx += x * x;
+    sxy += x * y;
+    extra[0] = '\0';
+    if (count > 1 && count * sxx - sx * sx > 0) {
+      drift = (count * sxy - sx * sy) / (count * sxx - sx * sx) * 1e6;
+      snprintf(extra, sizeof(extra), "drift=%+.3f", drift);
+    }
+    printedge(rtc, &realtime, uncertainty, extra);
+    if (x >= duration) {
+      break;
+    }
+  }
+  close(timerfile);
+  if (count < 2) {
+    printf("Error: The RTC must be timed at least twice to find its drift\n");
+    exit(2);
+  }
+
+  current = readi2cbyte(i2cdevice.bus,0x69,0x07);
+  factor = rtcfactor(drift, current, &residual);
+  printf("drift=%+.3f rtcfactor=%i recommended=%i residual=%+.3f\n",drift,current,factor,residual);
+  if (apply && factor != current) {
+    writei2cbyte(i2cdevice.bus,0x69,0x07,factor);
+    current = readi2cbyte(i2cdevice.bus,0x69,0x07);
+    if (current != factor) {
+      printf("Error: RTC Correction Factor reads back as %i rather than %i\n",current,factor);
+      exit(2);
+    }
+    printf("RTC Correction Factor set to: %i (0x%02x)\n",current,current);
+  }
+}
+
+/* Returns the correction factor cancelling a drift in ppm measured with the current factor in force,
+   and the drift in ppm it leaves. Factors 1 to 127 deduct that many ticks a second and 129 to 255 add
+   the factor less 128. 221, 238 and 255 are the factory reset, reset and bootloader commands of the
+   register, so are never recommended */
+int rtcfactor(double drift, int current, double *residual)
+{
+  double native = drift;
+  long ticks;
+  int factor;
+
+  if (current >= 1 && current <= 127) {
+    native += current * UPIS_RTC_TICK_PPM;
+  } else if (current >= 129) {
+    native -= (current - 128) * UPIS_RTC_TICK_PPM;
+  }
+  ticks = lround(-native / UPIS_RTC_TICK_PPM);
+  if (ticks < -127) {
+    ticks = -127;
+  } else if (ticks > 126) {
+    ticks = 126;
+  }
+  factor = ticks < 0 ? -ticks : ticks > 0 ? 128 + ticks : 0;
+  if (factor == 0xdd || factor == 0xee) {
+    factor--;
+  }
+  *residual = native + (factor >= 129 ? factor - 128 : -factor) * UPIS_RTC_TICK_PPM;
+  return factor;
+}
+
+/* Parses a number of seconds, or of minutes, hours or days followed by m, h or d. Returns -1 when invalid */
+long parseduration(const char *string)
+{
+  char *end;
+  long number = strtol(string, &end, 10);
+
+  if (end == string || number < 0 || (*end && (end[1] || !strchr("smhd", *end)))) {
+    return -1;
+  }
+  return number * (*end == 'm' ? 60 : *end == 'h' ? 3600 : *end == 'd' ? 86400 : 1);
+}
+
+/* Returns 1 when a --health check passes, 0 when it fails and -1 when it is not valid.
+   pid:PID and pid:PIDFILE check the process is running, file:PATH that PATH was modified
+   within timeout seconds. The pid file is read on every check, so a restarted process is followed */
+int healthcheck(const char *health, int timeout)
+{
+  struct stat status;
+  FILE *file;
+  long pid = 0;
+
+  if (strncmp(health,"pid:",4) == 0 && health[4]) {
+    if (is_intstr((char *)health + 4)) {
+      pid = atol(health + 4);
+    } else if ((file = fopen(health + 4,"r"))) {
+      if (fscanf(file,"%ld",&pid) != 1) {
+        pid = 0;
+      }
+      fclose(file);
+    }
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+  }
+  if (strncmp(health,"file:",5) == 0 && health[5]) {
+    return stat(health + 5, &status) == 0 && status.st_mtime + timeout > time(NULL);
+  }
+  return -1;
+}
+
+/* Writes one event line to notifyfd in a single write and starts hook, if any, with the event in its
+   environment. from and to are the power sources of a pwrsrc event, NULL for other events */
+void sendevent(const char *event, const char *from, const char *to, int batvolt, const char *hook, int notifyfd)
+{
+  struct timespec now;
+  char line[160];
+  char volts[16];
+  int length;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  snprintf(volts, sizeof(volts), "%0.2f", (double)batvolt / 100);
+  length = snprintf(line, sizeof(line), "time=%lld.%03ld event=%s", (long long)now.tv_sec, now.tv_nsec / 1000000, event);
+  if (from) {
+    length += snprintf(line + length, sizeof(line) - length, " from=%s to=%s", from, to);
+  }
+  if (batvolt) {
+    length += snprintf(line + length, sizeof(line) - length, " batvolt=%s", volts);
+  }
+  length += snprintf(line + length, sizeof(line) - length, "\n");
+  if (write(notifyfd, line, length) < 0) {
+    /* Nobody listening, the hook still runs */
+  }
+
+  if (hook && fork() == 0) {
+    setenv("UPIS_EVENT", event, 1);
+    setenv("UPIS_FROM", from ? from : "", 1);
+    setenv("UPIS_TO", to ? to : "", 1);
+    setenv("UPIS_BATVOLT", batvolt ? volts : "", 1);
+    execl("/bin/sh", "sh", "-c", hook, (char *)NULL);
+    _exit(127);
+  }
+}
+
+/* Validates the value to set a register to. Returns 0 when arg is out of range */
+int registerparse(const struct upisregister *reg, char *arg, int *value)
+{
+  if (reg->kind == UPIS_KIND_RELAY) {
+    strlower(arg);
+    if (strcmp(arg,"closed") == 0 || strcmp(arg,"1") == 0 || strcmp(arg,"on") == 0) {
+      *value = 0x01;
+    } else if (strcmp(arg,"open") == 0 || strcmp(arg,"0") == 0 || strcmp(arg,"off") == 0) {
+      *value = 0x00;
+    } else {
+      return 0;
+    }
+    return 1;
+  }
+  if (!is_intstr(arg) || atoi(arg) < reg->min || atoi(arg) > reg->max) {
+    return 0;
+  }
+  *value = atoi(arg);
+  return 1;
+}
+
+/* Displays a register option from the registers of its address, or reports the value it was set to.
+   arg is the option argument; labelled prefixes the value with its label */
+void registerprint(const struct upisregister *reg, const unsigned char *page, char *arg, int verbose, int labelled)
+{
+  static const char *pwrsrcnames[] = {"External Power [EPR]", "UPiS USB Power [USB]", "Raspberry Pi USB Power [RPI]",
+                                      "Battery Power [BAT]", "Low Power [LPR]", "[CPR]", "[BPR]"};
+  static const char *weekdays[] = {"Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday"};
+  char strtime[32];
+  struct tm rtc;
+  int value;
+
+  if (reg->kind == UPIS_KIND_TODO) {
+    printf("*** Not implemented yet ***\n");
+    return;
+  }
+  if (reg->kind == UPIS_KIND_ACTION) {
+    if (reg->done) {
+      printf("%s\n",reg->done);
+    }
+    return;
+  }
+
+  /* Report a value set */
+  if (arg && registersets(reg)) {
+    if (!registerparse(reg, arg, &value)) {
+      if (reg->kind == UPIS_KIND_RELAY) {
+        printf("Invalid argument '%s' for %s - use 0,1,open,closed,off or on\n",arg,reg->what);
+      } else {
+        printf("Invalid argument '%s' for %s - use an integer between %i and %i\n",arg,reg->what,reg->min,reg->max);
+      }
+    } else if (reg->kind == UPIS_KIND_RELAY) {
+      printf("Relay set to: %s\n",value ? "on/closed" : "off/open");
+    } else {
+      printf("%s set to: %i (0x%02x)\n",reg->label,page[reg->reg],page[reg->reg]);
+    }
+    return;
+  }
+
+  value = registervalue(reg, page);
+  if (reg->kind == UPIS_KIND_IOVALUE) {
+    if (page[reg->reg] > 3) {
+      printf("Error: Unexpected io pin mode: %i\n",page[reg->reg]);
+    } else if (value < 0) {
+      printf("IO Pin mode is not set\n");
+    } else {
+      if (verbose || labelled) {
+        printf("%s: ",reg->label);
+      }
+      printf("%i\n",value);
+    }
+    return;
+  }
+  if (labelled) {
+    printf("%s: ",reg->label);
+  }
+  switch (reg->kind) {
+    case UPIS_KIND_RTC:
+      decodertc(page, &rtc);
+      if (!arg) {
+        strftime(strtime,sizeof(strtime),"%d-%m-%Y %H:%M:%S",&rtc);
+        printf("%s (%s)\n",strtime,weekdays[rtc.tm_wday % 7]);
+      } else {
+        strlower(arg);
+        if (strcmp(arg,"epoch") == 0) {
+          printf("%lld\n",(long long)mktime(&rtc));
+        } else if (strcmp(arg,"iso") == 0) {
+          strftime(strtime,sizeof(strtime),"%Y-%m-%dT%H:%M:%S",&rtc);
+          printf("%s\n",strtime);
+        } else {
+          printf("Invalid argument '%s' for RTC format - use epoch or iso\n",arg);
+        }
+      }
+      break;
+    case UPIS_KIND_PWRSRC:
+      if (!verbose) {
+        printf("%u\n",value);
+      } else if (value < 1 || value > 7) {
+        printf("Error: Unexpected result for power mode: %u\n",value);
+      } else {
+        printf("%s\n",pwrsrcnames[value - 1]);
+      }
+      break;
+    case UPIS_KIND_RELAY:
+      if (verbose) {
+        printf("%s\n",value == 0 ? "on/closed" : "off/open");
+      } else {
+        printf("%i\n",value);
+      }
+      break;
+    default:
+      printf("%g",(double)value / reg->scale);
+      if (verbose && reg->unit) {
+        printf("%s",reg->unit);
+      }
+      if (verbose && reg->arg) {
+        printf(" (0x%02x)",value);
+      }
+      printf("\n");
+      break;
+  }
+}
+
+/* Displays a history summary as a table, voltages in Volts */
+void printhistory(const struct upishistory *history)
+{
+  static const char *names[UPIS_RING_VALUES] = {"batvolt", "rpivolt", "usbvolt", "eprvolt", "current", "centigrade", "fahrenheit"};
+  static const int scale[UPIS_RING_VALUES] = {100, 100, 100, 100, 1, 1, 1};
+  char strtime[32];
+  time_t seconds;
+  int counter;
+
+  printf("Records: %llu\n", history->count);
+  if (!history->count) {
+    return;
+  }
+  seconds = history->first / 1000;
+  strftime(strtime, sizeof(strtime), "%Y-%m-%dT%H:%M:%S", localtime(&seconds));
+  printf("From: %s\n", strtime);
+  seconds = history->last / 1000;
+  strftime(strtime, sizeof(strtime), "%Y-%m-%dT%H:%M:%S", localtime(&seconds));
+  printf("To: %s\n", strtime);
+  printf("%-12s %10s %10s %10s\n", "Value", "Min", "Max", "Mean");
+  for (counter = 0; counter < UPIS_RING_VALUES; counter++) {
+    printf("%-12s %10.2f %10.2f %10.2f\n", names[counter], (double)history->min[counter] / scale[counter],
+           (double)history->max[counter] / scale[counter], (double)history->sum[counter] / history->count / scale[counter]);
+  }
+  for (counter = 1; counter < 8; counter++) {
+    if (history->pwrsrc[counter]) {
+      printf("%s records: %llu\n", pwrsrcname(counter), history->pwrsrc[counter]);
+    }
+  }
+}
+
+/* Parses a history range endpoint into milliseconds since the epoch: epoch seconds,
+   a local YYYY-MM-DDTHH:MM:SS time or -N followed by s, m, h or d for a time before now.
+   Returns 0 when the string is none of these */
+int parsehistorytime(const char *string, int64_t *ms)
+{
+  struct tm local;
+  char *end;
+  long long number;
+  int length = 0;
+
+  if (string[0] == '-') {
+    number = strtoll(string + 1, &end, 10);
+    if (end == string + 1 || end[0] == '\0' || end[1] != '\0' || !strchr("smhd", end[0])) {
+      return 0;
+    }
+    number *= end[0] == 's' ? 1 : end[0] == 'm' ? 60 : end[0] == 'h' ? 3600 : 86400;
+    *ms = ((int64_t)time(NULL) - number) * 1000;
+    return 1;
+  }
+  memset(&local, 0, sizeof(local));
+  if (sscanf(string, "%4d-%2d-%2dT%2d:%2d:%2d%n", &local.tm_year, &local.tm_mon, &local.tm_mday,
+             &local.tm_hour, &local.tm_min, &local.tm_sec, &length) == 6 && string[length] == '\0') {
+    local.tm_year -= 1900;
+    local.tm_mon -= 1;
+    local.tm_isdst = -1;
+    *ms = (int64_t)mktime(&local) * 1000;
+    return 1;
+  }
+  number = strtoll(string, &end, 10);
+  if (end == string || *end) {
+    return 0;
+  }
+  *ms = number * 1000;
+  return 1;
+}
+
+/* Parses a comma separated list of numbers from min to max, decimal or 0x prefixed hex, into values.
+   Returns the number of values, or 0 when the list is invalid or longer than UPIS_DEVICES */
+unsigned int parselist(char *list, unsigned int *values, unsigned int min, unsigned int max)
+{
+  unsigned int count = 0;
+  unsigned long value;
+  char *end;
+
+  do {
+    value = strtoul(list, &end, 0);
+    if (end == list || (*end && *end != ',') || value < min || value > max || count == UPIS_DEVICES) {
+      return 0;
+    }
+    values[count++] = value;
+    list = end + 1;
+  } while (*end);
+  return count;
+}
+
+/* Reads a profile of name=value settings into values, indexed as upisregisters, -1 where a setting
+   is not given. Exits on a setting that cannot be set or a value out of range, before any is written */
+int readprofile(const char *path, int *values)
+{
+  FILE *file = strcmp(path,"-") == 0 ? stdin : fopen(path,"r");
+  const struct upisregister *reg;
+  const struct upisregister *action;
+  char line[BUFSIZ];
+  char *name;
+  char *value;
+  unsigned int number = 0;
+  unsigned int index;
+  int count = 0;
+
+  if (!file) {
+    printf("Error: Unable to open profile %s\n",path);
+    exit(1);
+  }
+  for (index = 0; index < UPIS_REGISTERS; index++) {
+    values[index] = -1;
+  }
+  while (fgets(line, sizeof(line), file)) {
+    number++;
+    name = strtok(line, " \t\r\n=");
+    if (!name || *name == '#') {
+      continue;
+    }
+    value = strtok(NULL, " \t\r\n=");
+    reg = registerfind(name);
+    if (!reg || !registersets(reg)) {
+      printf("Error: Line %u of profile %s: %s is not a setting of the UPiS\n",number,path,name);
+      exit(1);
+    }
+    index = reg - upisregisters;
+    if (!value || !registerparse(reg, value, &values[index])) {
+      printf("Error: Line %u of profile %s: invalid value for %s\n",number,path,reg->what);
+      exit(1);
+    }
+    if (strtok(NULL, " \t\r\n=")) {
+      printf("Error: Line %u of profile %s: more than one value for %s\n",number,path,reg->what);
+      exit(1);
+    }
+    /* Some values of a setting are commands, such as 238 for rtcfactor resetting the PiCo */
+    for (action = upisregisters; action < upisregisters + UPIS_REGISTERS; action++) {
+      if (action->kind == UPIS_KIND_ACTION && action->addr == reg->addr && action->reg == reg->reg && action->min == values[index]) {
+        printf("Error: Line %u of profile %s: %i for %s is the %s command\n",number,path,values[index],reg->what,action->what);
+        exit(1);
+      }
+    }
+    count++;
+  }
+  if (file != stdin) {
+    fclose(file);
+  }
+  return count;
+}
+
+/* Reads the current settings in one transaction, writes those that differ from values and reads
+   them back in a second. The bus lock is held throughout, so nothing changes in between. The relay
+   is not read back, as upis never has: the firmware does not document what its register reads as
+   once set, and -v displays a 0 as on/closed */
+void applyprofile(const int *values)
+{
+  const struct upisregister *reg;
+  struct upisplan current;
+  struct upisplan changes;
+  unsigned int index;
+  int changed = 0;
+
+  i2clock(i2cdevice.bus);
+  planinit(&current);
+  for (index = 0; index < UPIS_REGISTERS; index++) {
+    reg = &upisregisters[index];
+    if (values[index] >= 0) {
+      planread(&current, reg->addr, reg->reg, 1);
+    }
+  }
+  runplan(&current);
+
+  planinit(&changes);
+  for (index = 0; index < UPIS_REGISTERS; index++) {
+    reg = &upisregisters[index];
+    if (values[index] >= 0 && planbyte(&current, reg->addr, reg->reg) != values[index]) {
+      planwrite(&changes, reg->addr, reg->reg, values[index], reg->kind != UPIS_KIND_RELAY);
+    }
+  }
+  if (changes.writes) {
+    runplan(&changes);
+  }
+  i2cunlock();
+
+  for (index = 0; index < UPIS_REGISTERS; index++) {
+    reg = &upisregisters[index];
+    if (values[index] < 0 || planbyte(&current, reg->addr, reg->reg) == values[index]) {
+      continue;
+    }
+    if (reg->kind != UPIS_KIND_RELAY && planbyte(&changes, reg->addr, reg->reg) != values[index]) {
+      printf("Error: %s reads back as %i rather than %i\n",reg->label,planbyte(&changes, reg->addr, reg->reg),values[index]);
+      exit(2);
+    }
+    printf("%s=%i (was %i%s)\n",reg->name,values[index],planbyte(&current, reg->addr, reg->reg),reg->kind == UPIS_KIND_RELAY ? ", not read back" : "");
+    changed++;
+  }
+  if (!changed) {
+    printf("Settings already match the profile\n");
+  }
+}
+
+/* Displays every setting as a profile for --apply, read in one transaction */
+void dumpprofile(void)
+{
+  const struct upisregister *reg;
+  struct upisplan plan;
+  unsigned int index;
+
+  planinit(&plan);
+  for (index = 0; index < UPIS_REGISTERS; index++) {
+    reg = &upisregisters[index];
+    if (registersets(reg)) {
+      planread(&plan, reg->addr, reg->reg, 1);
+    }
+  }
+  runplan(&plan);
+  printf("# UPiS profile of bus %u address 0x%02x\n",i2cdevice.bus,i2cdevice.base);
+  for (index = 0; index < UPIS_REGISTERS; index++) {
+    reg = &upisregisters[index];
+    if (registersets(reg)) {
+      printf("%s=%i\n",reg->name,planbyte(&plan, reg->addr, reg->reg));
+    }
+  }
 }
-